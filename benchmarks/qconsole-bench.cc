@@ -0,0 +1,276 @@
+// Copyright (c) 2022 Kaiyan M. Lee
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#include <QConsole>
+#include <QtCore/QBuffer>
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QTemporaryDir>
+#include <functional>
+#include <random>
+
+namespace {
+// Run the operation until it took at least "minimum" nanoseconds in total, doubling the number of
+// iterations between checks of the clock, and return a JSON object with the average time of one
+// operation. The operation is given the index of the iteration.
+QJsonObject measure(const QString& name, size_t commands, qint64 minimum, const std::function<void(qint64)>& operation,
+                    qint64 operationsPerIteration = 1)
+{
+    QElapsedTimer timer;
+    qint64        iterations = 0;
+
+    timer.start();
+
+    for (qint64 batch = 1; iterations == 0 || timer.nsecsElapsed() < minimum; batch *= 2) {
+        for (qint64 i = 0; i < batch; ++i) {
+            operation(iterations + i);
+        }
+
+        iterations += batch;
+    }
+
+    const auto elapsed = timer.nsecsElapsed();
+    const auto average = double(elapsed) / double(iterations * operationsPerIteration);
+
+    fprintf(stderr, "%-16s %8zu commands: %12.1f ns\n", qPrintable(name), commands, average);
+
+    return QJsonObject{
+        { "name", name },
+        { "commands", qint64(commands) },
+        { "iterations", iterations * operationsPerIteration },
+        { "nanoseconds", average },
+    };
+}
+
+// Evaluate the script with the console, discarding the output.
+void evaluate(QConsole& console, QBuffer& output, const QByteArray& script)
+{
+    QBuffer input;
+    input.setData(script);
+    input.open(QBuffer::ReadOnly);
+
+    output.seek(0);
+    console.runScript(&input);
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    app.setApplicationName(QStringLiteral("qconsole-bench"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Measure the hot paths of QConsole at several command counts."));
+    parser.addHelpOption();
+    parser.addOptions({
+      { "sizes", "The comma-separated command counts. [default: 10,1000,100000,1000000]", "sizes",
+        "10,1000,100000,1000000" },
+      { "min-time", "The minimum time spent on each benchmark in milliseconds. [default: 200]", "msecs", "200" },
+      { "output", "The file the JSON results are written to. [default: stdout]", "path" },
+    });
+    parser.process(app);
+
+    const auto minimum = parser.value("min-time").toLongLong() * 1000000;
+
+    QJsonArray     results;
+    QTemporaryDir  dir;
+    std::mt19937   random(42);
+    constexpr auto Samples = 1024;
+
+    for (const auto& value : parser.value("sizes").split(',', Qt::SkipEmptyParts)) {
+        const auto size = size_t(value.toULongLong());
+
+        if (size == 0) {
+            continue;
+        }
+
+        QConsole console;
+        console.addDefaultCommands();
+
+        QBuffer output;
+        output.open(QBuffer::WriteOnly);
+        console.setOutputDevice(&output);
+
+        std::vector<QConsole::Command> commands;
+        commands.reserve(size);
+
+        for (size_t i = 0; i < size; ++i) {
+            commands.push_back({
+              QStringLiteral("command-%1").arg(i),
+              "Random description...",
+              [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+            });
+        }
+
+        // Register the commands in a new console, one by one and at once. The time per command
+        // includes copying it.
+        results.append(measure(
+          "populate-single", size, minimum,
+          [&](qint64) {
+              QConsole populated;
+
+              for (const auto& command : commands) {
+                  populated.addCommand(command);
+              }
+          },
+          qint64(size)));
+
+        results.append(measure(
+          "populate-bulk", size, minimum,
+          [&](qint64) {
+              QConsole populated;
+              populated.addCommands(commands);
+          },
+          qint64(size)));
+
+        console.addCommands(std::move(commands));
+
+        // Add and remove a command among the others, which detaches the root and invalidates its table.
+        const QConsole::Command churn{
+            "churn",
+            "Random description...",
+            [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+        };
+
+        results.append(measure("populate-churn", size, minimum, [&](qint64) {
+            console.addCommand(churn);
+            console.removeCommandByName(churn.name);
+        }));
+
+        // The names and lines used by the benchmarks, picked at random among the commands.
+        QList<QString> names;
+        QList<QString> prefixes;
+        QList<QString> lines;
+        QByteArray     script;
+
+        for (int i = 0; i < Samples; ++i) {
+            const auto name = QStringLiteral("command-%1").arg(random() % size);
+
+            names.append(name);
+            prefixes.append(name.chopped(1));
+            lines.append(QString(name + QStringLiteral(" --verbose 'quoted argument' 42")));
+            script.append(lines.back().toUtf8()).append('\n');
+        }
+
+        results.append(measure("lookup", size, minimum,
+                               [&](qint64 i) { console.invokeCommandByName(names[i % Samples]); }));
+
+        results.append(
+          measure("completion", size, minimum, [&](qint64 i) { console.complete(prefixes[i % Samples]); }));
+
+        results.append(measure("hint", size, minimum, [&](qint64 i) { console.hint(prefixes[i % Samples]); }));
+
+        // Type the lines one character at a time.
+        results.append(measure("highlight", size, minimum, [&](qint64 i) {
+            const auto& line = lines[(i / 48) % Samples];
+            console.highlight(line.left(i % 48 + 1));
+        }));
+
+        results.append(measure(
+          "evaluate", size, minimum, [&](qint64) { evaluate(console, output, script); }, Samples));
+
+        results.append(measure("help", size, minimum, [&](qint64) { evaluate(console, output, "help"); }));
+
+        // The history has as many entries as there are commands.
+        const auto legacy  = dir.filePath(QStringLiteral("legacy-%1.txt").arg(size));
+        const auto journal = dir.filePath(QStringLiteral("journal-%1.txt").arg(size));
+        const auto saved   = dir.filePath(QStringLiteral("saved-%1.txt").arg(size));
+
+        QFile file(legacy);
+
+        if (!file.open(QIODevice::WriteOnly)) {
+            fprintf(stderr, "Failed to write %s\n", qPrintable(legacy));
+            return EXIT_FAILURE;
+        }
+
+        for (size_t i = 0; i < size; ++i) {
+            file.write(QStringLiteral("### 2022-01-01 10:00:00.000\n%1 argument-%2\n")
+                         .arg(names[i % Samples])
+                         .arg(i)
+                         .toUtf8());
+        }
+
+        file.close();
+
+        // Add the lines to the history of a new journal. Destroying the console waits for the writer to
+        // commit them.
+        results.append(measure(
+          "history-save", size, minimum,
+          [&](qint64) {
+              QFile::remove(saved);
+
+              QConsole history;
+              history.setMaxHistorySize(int(size));
+              history.setHistoryFilePath(saved);
+
+              for (size_t i = 0; i < size; ++i) {
+                  history.addHistoryItem(lines[int(i % Samples)]);
+              }
+          },
+          qint64(size)));
+
+        results.append(measure("history-convert", size, minimum, [&](qint64) {
+            QFile::remove(journal);
+            QFile::copy(legacy, journal);
+
+            // Loading a legacy file writes it back as a journal.
+            QConsole history;
+            history.setMaxHistorySize(int(size));
+            history.setHistoryFilePath(journal);
+        }));
+
+        results.append(measure("history-load", size, minimum, [&](qint64) {
+            QConsole history;
+            history.setMaxHistorySize(int(size));
+            history.setHistoryFilePath(journal);
+        }));
+
+        QConsole history;
+        history.setMaxHistorySize(int(size));
+        history.setHistoryFilePath(journal);
+
+        results.append(measure("history-search", size, minimum,
+                               [&](qint64 i) { history.searchHistory(prefixes[i % Samples]); }));
+    }
+
+    const auto json = QJsonDocument(QJsonObject{ { "qt", qVersion() }, { "benchmarks", results } }).toJson();
+
+    if (!parser.isSet("output")) {
+        fwrite(json.constData(), 1, size_t(json.size()), stdout);
+        return EXIT_SUCCESS;
+    }
+
+    QFile file(parser.value("output"));
+
+    if (!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+        fprintf(stderr, "Failed to write %s\n", qPrintable(parser.value("output")));
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
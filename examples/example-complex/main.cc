@@ -24,8 +24,10 @@
 #include <QConsole>
 #include <QtCore/QCoreApplication>
 #include <QtCore/QDir>
+#include <QtCore/QFileInfo>
 #include <QtCore/QLoggingCategory>
 #include <QtCore/QProcess>
+#include <QtCore/QPromise>
 #include <QtCore/QStandardPaths>
 #include <QtNetwork/QNetworkAccessManager>
 #include <QtNetwork/QNetworkReply>
@@ -36,6 +38,7 @@ int main(int argc, char** argv)
     auto serverHost = "localhost";
     auto serverPort = 4443;
     auto history    = "./history.txt";
+    auto listen     = "";
 
     for (int i = 1; i < argc; ++i) {
         if (const auto& a = argv[i]; strcmp(a, "--help") == 0 || strcmp(a, "-h") == 0) {
@@ -50,6 +53,7 @@ int main(int argc, char** argv)
             puts("  -v or --version         Print the version string.");
             puts("");
             puts("  --history     <value>   Disable all message logging.");
+            puts("  --listen      <value>   Accept console sessions on the local socket.");
             puts("  --server-host <value>   The server host. [default: localhost]");
             puts("  --server-port <value>   The server port. [default: 4443]");
             puts("");
@@ -61,6 +65,8 @@ int main(int argc, char** argv)
         } else if (strcmp(a, "--version") == 0 || strcmp(a, "-v") == 0) {
             puts("Example 0.0.1");
             return EXIT_SUCCESS;
+        } else if (strcmp(a, "--listen") == 0 && (i + 1) <= argc) {
+            listen = argv[++i];
         } else if (strcmp(a, "--server-host") == 0 && (i + 1) <= argc) {
             serverHost = argv[++i];
         } else if (strcmp(a, "--server-port") == 0 && (i + 1) <= argc) {
@@ -84,101 +90,151 @@ int main(int argc, char** argv)
     qInstallMessageHandler([](QtMsgType type, const QMessageLogContext& context, const QString& message) {
         Q_UNUSED(context);
 
+        // Messages may be logged from any thread so we use the thread-safe "print" method.
         switch (type) {
         case QtInfoMsg:
         case QtDebugMsg:
-            c.ostream() << message << Qt::endl;
+            c.print(message + '\n');
             break;
         case QtCriticalMsg:
-            c.ostream() << QConsole::colorize(QStringLiteral("Error: ").append(message), QConsole::Color::Red,
-                                              QConsole::Style::Normal)
-                        << Qt::endl;
+            c.print(QConsole::colorize(QStringLiteral("Error: ").append(message), QConsole::Color::Red,
+                                       QConsole::Style::Normal)
+                    + '\n');
             break;
         case QtWarningMsg:
-            c.ostream() << QConsole::colorize(QStringLiteral("Warning: ").append(message), QConsole::Color::Red,
-                                              QConsole::Style::Normal)
-                        << Qt::endl;
+            c.print(QConsole::colorize(QStringLiteral("Warning: ").append(message), QConsole::Color::Red,
+                                       QConsole::Style::Normal)
+                    + '\n');
             break;
         case QtFatalMsg:
-            c.ostream() << QConsole::colorize(QStringLiteral("Fatal: ").append(message), QConsole::Color::Red,
-                                              QConsole::Style::Normal)
-                        << Qt::endl;
+            c.print(QConsole::colorize(QStringLiteral("Fatal: ").append(message), QConsole::Color::Red,
+                                       QConsole::Style::Normal)
+                    + '\n');
         }
     });
 
+    c.setSharedHistory(true);
     c.setHistoryFilePath(history);
+    c.setInputMode(QConsole::InputMode::Asynchronous);
+    c.setFuzzyCompletion(true);
     c.setDefaultPrompt(QStringLiteral("[?][%1]: ").arg(QConsole::colorize("#", QConsole::Color::Red)));
 
+    QNetworkAccessManager nm;
+
     c.addCommand({
       "http-get",
-      "Send an http request to showcase QEventLoop capabilities.",
+      "Send an http request to showcase asynchronous commands.",
+      nullptr,
+      nullptr,
       [&](const QConsole::Context& ctx) {
-          QNetworkAccessManager nm;
+          const auto promise = std::make_shared<QPromise<void>>();
+          promise->start();
 
-          QNetworkRequest request(ctx.arguments.join(" "));
-          QNetworkReply*  reply = nm.get(request);
+          QNetworkReply* reply = nm.get(QNetworkRequest(ctx.arguments.join(" ")));
 
-          QEventLoop loop;
-          QObject::connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
-          loop.exec();
+          QObject::connect(reply, &QNetworkReply::finished, [reply, promise, output = ctx.output]() {
+              if (reply->error() == QNetworkReply::NoError) {
+                  *output << reply->readAll() << Qt::endl;
+              } else {
+                  *output << reply->errorString() << Qt::endl;
+              }
 
-          if (reply->error() == QNetworkReply::NoError) {
-              c.ostream() << reply->readAll() << Qt::endl;
-          } else {
-              qWarning() << reply->errorString();
-          }
+              reply->deleteLater();
+              promise->finish();
+          });
 
-          reply->deleteLater();
+          return promise->future();
       },
     });
 
+    // Complete the paths of the files under the directory of the argument.
+    const auto completePath = [](const QConsole::CompletionRequest& request) {
+        const auto& prefix = request.prefix();
+        const auto  dir    = prefix.left(prefix.lastIndexOf('/') + 1);
+
+        QList<QString> paths;
+
+        for (const auto& entry : QDir(dir.isEmpty() ? QStringLiteral(".") : dir)
+                                   .entryInfoList(QDir::AllEntries | QDir::NoDotAndDotDot)) {
+            if (request.isCanceled()) {
+                break;
+            }
+
+            if (auto path = dir + entry.fileName() + (entry.isDir() ? "/" : ""); path.startsWith(prefix)) {
+                paths.append(path);
+            }
+        }
+
+        return paths;
+    };
+
     c.addCommand({
       "shell",
-      "Add executable programs found under $PATH as commands.",
+      "Run the executable programs found under $PATH as commands.",
       [&](const QConsole::Context& ctx) {
           Q_UNUSED(ctx);
 
-          for (auto path : qEnvironmentVariable("PATH").split(QDir::listSeparator())) {
-              QDir dir(path);
-              dir.setFilter(QDir::Files);
+          const auto paths = qEnvironmentVariable("PATH").split(QDir::listSeparator(), Qt::SkipEmptyParts);
+
+          // The programs are looked up when they are first used instead of being registered up front,
+          // and the lookups are cached until a directory of $PATH changes.
+          c.addCommandSource({
+            [paths, completePath](const QString& name) -> std::optional<QConsole::Command> {
+                for (const auto& path : paths) {
+                    const QFileInfo entry(QDir(path).filePath(name));
+
+                    if (!entry.isFile() || !entry.isExecutable()) {
+                        continue;
+                    }
+
+                    return QConsole::Command{
+                        name,
+                        "[executable]",
+                        [program = entry.filePath()](const QConsole::Context& ctx) {
+                            QProcess process;
+
+                            process.start(program, ctx.arguments.toList());
+
+                            if (!process.waitForStarted(1000)) {
+                                qCritical() << process.error();
+                                return;
+                            }
+
+                            process.closeWriteChannel();
+
+                            if (!process.waitForFinished()) {
+                                qCritical() << process.error();
+                                return;
+                            }
+
+                            // Write to the context so that the programs can be piped (ex. "ls | grep txt").
+                            if (process.exitCode() == 0) {
+                                *ctx.output << process.readAllStandardOutput();
+                            } else {
+                                *ctx.output << process.readAllStandardError();
+                            }
+
+                            ctx.output->flush();
+                        },
+                        nullptr,
+                        nullptr,
+                        completePath,
+                    };
+                }
 
-              if (dir.count() == 0) {
-                  continue;
-              }
+                return std::nullopt;
+            },
+            [paths](const QString& prefix) {
+                QList<QString> names;
 
-              for (auto entry : dir.entryInfoList()) {
-                  auto program = entry.fileName();
-                  c.addCommand({
-                    program,
-                    "[executable]",
-                    [program](const QConsole::Context& ctx) {
-                        QProcess process;
-
-                        process.start(program, ctx.arguments);
-
-                        if (!process.waitForStarted(1000)) {
-                            qCritical() << process.error();
-                            return;
-                        }
-
-                        process.closeWriteChannel();
-
-                        if (!process.waitForFinished()) {
-                            qCritical() << process.error();
-                            return;
-                        }
-
-                        if (process.exitCode() == 0) {
-                            c.ostream() << process.readAllStandardOutput();
-                        } else {
-                            c.ostream() << process.readAllStandardError();
-                        }
-
-                        c.ostream().flush();
-                    },
-                  });
-              }
-          }
+                for (const auto& path : paths) {
+                    names.append(QDir(path).entryList({ prefix + '*' }, QDir::Files | QDir::Executable));
+                }
+
+                return names;
+            },
+            paths,
+          });
       },
     });
 
@@ -250,6 +306,11 @@ int main(int argc, char** argv)
       },
     });
 
+    // Let operators attach to the example (ex. "socat READLINE UNIX-CONNECT:/tmp/<value>").
+    if (strlen(listen) > 0 && !c.listen(listen)) {
+        qCritical() << "Could not listen on" << listen;
+    }
+
     c.start();
 
     return app.exec();
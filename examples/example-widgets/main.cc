@@ -63,8 +63,9 @@ int main(int argc, char** argv)
       [&](const QConsole::Context& ctx) {
           // Note that we have to invoke the method from the main thread since our current
           // context is the QConsole thread.
+          // The arguments are only valid until the command returns, so they are converted first.
           QMetaObject::invokeMethod(
-            textEdit, [=]() { textEdit->setText(ctx.arguments.join(" ")); }, Qt::QueuedConnection);
+            textEdit, [=, text = ctx.arguments.join(" ")]() { textEdit->setText(text); }, Qt::QueuedConnection);
       },
     });
 
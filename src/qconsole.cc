@@ -27,326 +27,5598 @@
 #include <tsl/htrie_map.h>
 
 #include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
 #include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QFileSystemWatcher>
+#include <QtCore/QFutureWatcher>
+#include <QtCore/QLockFile>
+#include <QtCore/QMutex>
+#include <QtCore/QPointer>
+#include <QtCore/QPromise>
+#include <QtCore/QRegularExpression>
+#include <QtCore/QSaveFile>
+#include <QtCore/QScopeGuard>
+#include <QtCore/QSemaphore>
+#include <QtCore/QSet>
 #include <QtCore/QStandardPaths>
 #include <QtCore/QTimer>
+#include <QtCore/QWaitCondition>
+#include <QtCore/QtAlgorithms>
+#include <QtCore/QtEndian>
+#include <QtNetwork/QLocalServer>
+#include <QtNetwork/QLocalSocket>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
 #include <regex>
 #include <replxx.hxx>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #ifdef Q_OS_WIN32
+#include <conio.h>
+#include <io.h>
 #include <windows.h>
 #else
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <termios.h>
 #include <unistd.h>
 #endif
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QCONSOLE_SSE2
+#endif
+
 #include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+
+using namespace replxx;
+
+// Node is an entry of the command tree. A node is a command, a group of subcommands, or both, and
+// owns the index of its children so that lookups descend the tree one word at a time.
+struct QConsole::Node
+{
+    // The command. Groups only use the name and the description.
+    Command command;
+
+    // True if the command can be invoked.
+    bool invokable = false;
+
+    // The subcommands, indexed by their last word. The children are shared with the snapshots of
+    // the commands, so they must be detached before being modified.
+    std::shared_ptr<Trie> children;
+
+    // The perfect hash table over the children when the commands are frozen. It points into the
+    // children, so it's dropped when they are detached and rebuilt before the next lookup.
+    std::shared_ptr<PerfectHash> frozen;
+
+    // The fuzzy completion index over the children, built on demand and dropped when they change.
+    mutable std::shared_ptr<FuzzyIndex> fuzzy;
+
+    // The statistics of the command, allocated when it becomes invokable. The copies of the node in
+    // the snapshots share them, and the pointer doesn't change once the node is published.
+    std::shared_ptr<Statistics> statistics;
+
+    // Build or drop the perfect hash tables of this node and its descendants.
+    void freeze(bool enable);
+
+    // Build the perfect hash table of this node only. The table is left empty if the children
+    // can't be hashed without collisions, in which case the lookups use the trie.
+    void refreeze();
+
+    // Return the children to be modified, copying them first if a snapshot shares them.
+    Trie& detachChildren();
+};
+
+class QConsole::Trie : public tsl::htrie_map<char, QConsole::Node>
+{
+public:
+    Trie()
+    {
+        burst_threshold(0);
+        max_load_factor(1.0);
+    }
+};
+
+// Return the number of code points in an UTF-8 encoded string.
+static int codePointCount(std::string_view str)
+{
+    int count = 0;
+
+    for (const unsigned char c : str) {
+        count += (c & 0xC0) != 0x80;
+    }
+
+    return count;
+}
+
+// Return the last command of a line, which is the whole line if there are no unquoted operators.
+static std::string_view lastCommand(std::string_view line)
+{
+    size_t start = 0;
+    char   quote = 0;
+
+    for (size_t i = 0; i < line.size(); ++i) {
+        const char c = line[i];
+
+        if (c == '\\' && quote != '\'') {
+            i++;
+        } else if (quote != 0) {
+            quote = c == quote ? 0 : quote;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        } else if (c == '|' || c == '&' || c == ';') {
+            start = i + 1;
+        }
+    }
+
+    line.remove_prefix(std::min(line.find_first_not_of(" \t", start), line.size()));
+
+    return line;
+}
+
+class QConsole::Terminal : public replxx::Replxx
+{
+};
+
+// OutputQueue is a lock-free multi-producer single-consumer queue of pending output. Producers
+// push from any thread and the consumer pops everything that has been pushed in one batch. The
+// consumer is usually the console thread; the drain lock of the console serializes the others.
+class QConsole::OutputQueue
+{
+public:
+    OutputQueue()
+      : m_head(&m_stub)
+      , m_tail(&m_stub)
+      , m_pending(false)
+    {
+        m_stub.next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~OutputQueue()
+    {
+        QString text;
+
+        while (pop(text)) {
+        }
+    }
+
+    // Push text onto the queue. Returns true if the consumer has to be notified, which only happens
+    // for the first push after the consumer started draining.
+    bool push(QString&& text)
+    {
+        enqueue(new Node{ { nullptr }, std::move(text) });
+        return !m_pending.exchange(true);
+    }
+
+    // Called by the consumer before popping so that the next push notifies it again.
+    void beginDrain()
+    {
+        m_pending = false;
+    }
+
+    // Pop everything that has been pushed so far, oldest first.
+    QString drain()
+    {
+        beginDrain();
+
+        QString batch;
+        QString text;
+
+        while (pop(text)) {
+            batch.append(text);
+        }
+
+        return batch;
+    }
+
+    // Pop the oldest text. Returns false if the queue is empty or if a producer is in the middle of
+    // a push, in which case that producer will notify the consumer again.
+    bool pop(QString& text)
+    {
+        Node* tail = m_tail;
+        Node* next = tail->next.load(std::memory_order_acquire);
+
+        if (tail == &m_stub) {
+            if (next == nullptr) {
+                return false;
+            }
+
+            m_tail = next;
+            tail   = next;
+            next   = next->next.load(std::memory_order_acquire);
+        }
+
+        if (next == nullptr) {
+            if (tail != m_head.load(std::memory_order_acquire)) {
+                return false;
+            }
+
+            enqueue(&m_stub);
+            next = tail->next.load(std::memory_order_acquire);
+
+            if (next == nullptr) {
+                return false;
+            }
+        }
+
+        m_tail = next;
+        text   = std::move(tail->text);
+        delete tail;
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node*> next;
+        QString            text;
+    };
+
+    void enqueue(Node* node)
+    {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = m_head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    Node               m_stub;
+    std::atomic<Node*> m_head;
+    Node*              m_tail;
+    std::atomic_bool   m_pending;
+};
+
+// PerfectHash is a minimal perfect hash table over a frozen set of command names, built with the
+// hash and displace algorithm: each name is hashed once to select a bucket and the displacement of
+// that bucket selects a unique slot, so a lookup costs one hash and one comparison.
+class QConsole::PerfectHash
+{
+public:
+    // The number of seeds tried before giving up.
+    static constexpr uint64_t MaxSeeds = 32;
+
+    // Build the table. Returns false if no seed worked, in which case the trie should be used. The
+    // children must not be modified until the table is rebuilt.
+    bool build(const Trie& trie)
+    {
+        std::vector<std::pair<std::string, const Node*>> entries;
+        entries.reserve(trie.size());
+
+        for (auto iter = trie.begin(); iter != trie.end(); ++iter) {
+            entries.emplace_back(iter.key(), &iter.value());
+        }
+
+        // A seed fails if two names have the same 64-bit hash, or if a bucket finds no free slots
+        // within 2^20 displacements. The table grows by a quarter every four failed seeds so that
+        // the buckets are easier to place.
+        for (m_seed = 0; m_seed < MaxSeeds; m_seed++) {
+            if (build(entries, entries.size() + entries.size() * (m_seed / 4) / 4)) {
+                return true;
+            }
+        }
+
+        m_slots.clear();
+        m_displacements.clear();
+        m_names.clear();
+
+        return false;
+    }
+
+    const Node* find(std::string_view name) const
+    {
+        if (m_slots.empty()) {
+            return nullptr;
+        }
+
+        const auto  h    = hash(name);
+        const auto& slot = m_slots[position(h, m_displacements[bucket(h)])];
+
+        if (slot.node != nullptr && std::string_view(m_names.data() + slot.offset, slot.size) == name) {
+            return slot.node;
+        }
+
+        return nullptr;
+    }
+
+private:
+    struct Slot
+    {
+        uint32_t    offset;
+        uint32_t    size;
+        const Node* node;
+    };
+
+    bool build(const std::vector<std::pair<std::string, const Node*>>& entries, size_t slots)
+    {
+        // Four names per bucket on average.
+        m_names.clear();
+        m_slots.assign(slots, Slot{ 0, 0, nullptr });
+        m_displacements.assign(std::max<size_t>(1, entries.size() / 4), 0);
+
+        std::vector<std::vector<std::pair<uint64_t, size_t>>> buckets(m_displacements.size());
+
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const auto h = hash(entries[i].first);
+            buckets[bucket(h)].emplace_back(h, i);
+        }
+
+        // Place the largest buckets first while most of the slots are still free.
+        std::vector<size_t> order(buckets.size());
+
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
+        }
+
+        std::sort(order.begin(), order.end(), [&buckets](size_t a, size_t b) {
+            return buckets[a].size() > buckets[b].size();
+        });
+
+        std::vector<bool>   used(slots, false);
+        std::vector<size_t> positions;
+
+        for (const auto b : order) {
+            if (buckets[b].empty()) {
+                break;
+            }
+
+            for (uint32_t d = 0;; d++) {
+                if (d == (1u << 20)) {
+                    return false;
+                }
+
+                positions.clear();
+
+                for (const auto& [h, i] : buckets[b]) {
+                    const auto p = position(h, d);
+
+                    if (used[p] || std::find(positions.begin(), positions.end(), p) != positions.end()) {
+                        break;
+                    }
+
+                    positions.push_back(p);
+                }
+
+                if (positions.size() == buckets[b].size()) {
+                    m_displacements[b] = d;
+                    break;
+                }
+            }
+
+            for (size_t k = 0; k < positions.size(); ++k) {
+                const auto& e = entries[buckets[b][k].second];
+
+                used[positions[k]]    = true;
+                m_slots[positions[k]] = Slot{ uint32_t(m_names.size()), uint32_t(e.first.size()), e.second };
+                m_names.append(e.first);
+            }
+        }
+
+        return true;
+    }
+
+    static uint64_t mix(uint64_t h)
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    uint64_t hash(std::string_view name) const
+    {
+        uint64_t h = 0xcbf29ce484222325ULL ^ m_seed;
+
+        for (const unsigned char c : name) {
+            h ^= c;
+            h *= 0x100000001b3ULL;
+        }
+
+        return mix(h);
+    }
+
+    size_t bucket(uint64_t h) const
+    {
+        return (h >> 32) % m_displacements.size();
+    }
+
+    size_t position(uint64_t h, uint32_t d) const
+    {
+        return mix(h + d * 0x9e3779b97f4a7c15ULL) % m_slots.size();
+    }
+
+    uint64_t              m_seed = 0;
+    std::string           m_names;
+    std::vector<uint32_t> m_displacements;
+    std::vector<Slot>     m_slots;
+};
+
+void QConsole::Node::freeze(bool enable)
+{
+    frozen.reset();
+
+    if (children) {
+        auto& trie = detachChildren();
+
+        for (auto iter = trie.begin(); iter != trie.end(); ++iter) {
+            iter.value().freeze(enable);
+        }
+
+        if (enable) {
+            refreeze();
+        }
+    }
+}
+
+void QConsole::Node::refreeze()
+{
+    frozen.reset();
+
+    if (children && !children->empty()) {
+        auto table = std::make_shared<PerfectHash>();
+
+        if (table->build(*children)) {
+            frozen = std::move(table);
+        }
+    }
+}
+
+QConsole::Trie& QConsole::Node::detachChildren()
+{
+    // The table would keep pointing into the children once they're copied or modified.
+    frozen.reset();
+
+    if (!children) {
+        children = std::make_shared<Trie>();
+    } else if (children.use_count() > 1) {
+        children = std::make_shared<Trie>(*children);
+    } else {
+        // The last snapshot sharing the children may have just been released by another thread.
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+
+    return *children;
+}
+
+// FuzzyIndex packs the names of the children of a node into one contiguous, lower-cased buffer
+// that fuzzy completion scans linearly. A mask of the characters of each name rejects most names
+// without reading them, and the names left are matched a vector of bytes at a time.
+class QConsole::FuzzyIndex
+{
+public:
+    explicit FuzzyIndex(const Trie& trie)
+    {
+        std::string key;
+
+        for (auto iter = trie.begin(); iter != trie.end(); ++iter) {
+            iter.key(key);
+            m_offsets.push_back(uint32_t(m_names.size()));
+            m_names.append(key);
+        }
+
+        m_offsets.push_back(uint32_t(m_names.size()));
+        m_lower = m_names;
+        m_masks.reserve(m_offsets.size() - 1);
+        m_starts.reserve(m_offsets.size() - 1);
+
+        for (size_t i = 0; i + 1 < m_offsets.size(); ++i) {
+            uint64_t mask   = 0;
+            uint64_t starts = 1;
+
+            for (auto k = m_offsets[i]; k < m_offsets[i + 1]; ++k) {
+                m_lower[k] = toLower(m_lower[k]);
+                mask |= charMask(m_lower[k]);
+
+                if (const auto position = k - m_offsets[i] + 1; position < 64 && isSeparator(m_lower[k])) {
+                    starts |= uint64_t(1) << position;
+                }
+            }
+
+            m_masks.push_back(mask);
+            m_starts.push_back(starts);
+        }
+
+        // Vector loads may read up to 64 bytes from the start of the last name.
+        m_lower.append(64, '\0');
+    }
+
+    // Append the names matching the query as a subsequence to the list, best match first. At most
+    // "count" names are returned. The indices of all the matching names are stored in "candidates";
+    // if "narrow" is true, only the names already in there are considered, which is enough when the
+    // query extends the query that produced them.
+    void match(std::string_view query, size_t count, std::vector<uint32_t>& candidates, bool narrow,
+               std::vector<std::string>& out) const
+    {
+        std::string lower(query);
+        uint64_t    mask = 0;
+
+        for (auto& c : lower) {
+            c = toLower(c);
+            mask |= charMask(c);
+        }
+
+        // The best matches so far, as a heap whose top is the worst of them.
+        std::vector<std::pair<int, uint32_t>> best;
+        best.reserve(count);
+
+        const auto better = [this](const std::pair<int, uint32_t>& a, const std::pair<int, uint32_t>& b) {
+            if (a.first != b.first) {
+                return a.first > b.first;
+            }
+
+            return size(a.second) < size(b.second) || (size(a.second) == size(b.second) && a.second < b.second);
+        };
+
+        const auto total = narrow ? candidates.size() : m_masks.size();
+        size_t     kept  = 0;
+
+        if (!narrow) {
+            candidates.clear();
+        }
+
+        for (size_t k = 0; k < total; ++k) {
+            const auto i = narrow ? candidates[k] : uint32_t(k);
+
+            if ((mask & ~m_masks[i]) != 0) {
+                continue;
+            }
+
+            const auto s = score(i, lower);
+
+            if (s == NoMatch) {
+                continue;
+            }
+
+            if (narrow) {
+                candidates[kept++] = i;
+            } else {
+                candidates.push_back(i);
+            }
+
+            if (count == 0) {
+                continue;
+            }
+
+            if (best.size() < count) {
+                best.emplace_back(s, i);
+                std::push_heap(best.begin(), best.end(), better);
+            } else if (better({ s, i }, best.front())) {
+                std::pop_heap(best.begin(), best.end(), better);
+                best.back() = { s, i };
+                std::push_heap(best.begin(), best.end(), better);
+            }
+        }
+
+        if (narrow) {
+            candidates.resize(kept);
+        }
+
+        std::sort_heap(best.begin(), best.end(), better);
+
+        for (const auto& match : best) {
+            out.emplace_back(m_names, m_offsets[match.second], size(match.second));
+        }
+    }
+
+private:
+    static constexpr int NoMatch = std::numeric_limits<int>::min();
+
+    static char toLower(char c)
+    {
+        return c >= 'A' && c <= 'Z' ? char(c - 'A' + 'a') : c;
+    }
+
+    static uint64_t charMask(char c)
+    {
+        return uint64_t(1) << (static_cast<unsigned char>(c) & 63);
+    }
+
+    static bool isSeparator(char c)
+    {
+        return c == '-' || c == '_' || c == '.' || c == '/' || c == ':';
+    }
+
+    uint32_t size(uint32_t i) const
+    {
+        return m_offsets[i + 1] - m_offsets[i];
+    }
+
+    // Return a mask of the positions of the character in the first "size" bytes of the name.
+    static uint64_t positions(const char* name, uint32_t size, char c)
+    {
+        uint64_t bits = 0;
+#ifdef QCONSOLE_SSE2
+        const __m128i needle = _mm_set1_epi8(c);
+
+        for (uint32_t k = 0; k < size; k += 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(name + k));
+            bits |= uint64_t(unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle)))) << k;
+        }
+#else
+        for (uint32_t k = 0; k < size; ++k) {
+            bits |= uint64_t(name[k] == c) << k;
+        }
+#endif
+        return size < 64 ? bits & ((uint64_t(1) << size) - 1) : bits;
+    }
+
+    // Score the leftmost subsequence match of the query in the first 64 bytes of the name. Matches
+    // at the start of words and consecutive matches are rewarded while gaps are penalized.
+    int score(uint32_t i, std::string_view query) const
+    {
+        const char* name     = m_lower.data() + m_offsets[i];
+        const auto  length   = std::min<uint32_t>(size(i), 64);
+        int         previous = -1;
+        int         score    = 0;
+
+        for (const char c : query) {
+            const auto bits = previous < 63 ? positions(name, length, c) & (~uint64_t(0) << (previous + 1)) : 0;
+
+            if (bits == 0) {
+                return NoMatch;
+            }
+
+            const int hit = int(qCountTrailingZeroBits(quint64(bits)));
+
+            score += 16;
+
+            if ((m_starts[i] >> hit) & 1) {
+                score += 8;
+            }
+
+            if (previous >= 0 && hit == previous + 1) {
+                score += 12;
+            } else {
+                score -= std::min(hit - previous - 1, 8);
+            }
+
+            previous = hit;
+        }
+
+        return score;
+    }
+
+    std::string           m_names;
+    std::string           m_lower;
+    std::vector<uint32_t> m_offsets;
+    std::vector<uint64_t> m_masks;
+    std::vector<uint64_t> m_starts;
+};
+
+// CompletionCache keeps the candidates of the last completed word. While the user extends the word,
+// the next candidates are a subset of the cached ones, so they are narrowed down instead of being
+// searched for again. The cache is dropped when the word gets shorter or the commands change.
+struct QConsole::CompletionCache
+{
+    struct Entry
+    {
+        // The node that was completed and the generation of the commands at that time.
+        const Node* node       = nullptr;
+        quint64     generation = 0;
+
+        // The completed word.
+        std::string prefix;
+
+        // The names starting with the word.
+        std::vector<std::string> names;
+
+        // The indices of the names matching the word in the fuzzy index of the node.
+        std::vector<uint32_t> candidates;
+
+        // Check if the candidates of the completion are a subset of the cached ones.
+        bool contains(const Node* n, quint64 g, std::string_view p) const
+        {
+            return n == node && g == generation && p.size() >= prefix.size()
+                   && p.compare(0, prefix.size(), prefix) == 0;
+        }
+    };
+
+    // One entry per completion mode since hints are always completed by prefix.
+    Entry prefix;
+    Entry fuzzy;
+};
+
+// PendingCompletion is an argument completion running on the completion thread pool. The results
+// are published before the semaphore is released.
+struct QConsole::PendingCompletion
+{
+    PendingCompletion(const QString& key, const QList<QString>& arguments, const QString& prefix, int timeout)
+      : key(key)
+      , request(arguments, prefix, timeout)
+    {
+    }
+
+    QString           key;
+    CompletionRequest request;
+    QList<QString>    results;
+    QSemaphore        finished;
+};
+
+// SourceCache holds the command sources and what they answered so far. It is used by lookups from
+// the reader threads too. The sources are asked without holding the lock, and their answers are
+// published copy-on-write: the lookups read the current table of answers, and an answer replaces
+// it with a copy holding the answer.
+struct QConsole::SourceCache
+{
+    struct Table
+    {
+        // The commands provided by the sources by name.
+        QHash<QString, std::shared_ptr<Node>> commands;
+
+        // The names no source knows. They're forgotten once there are "MaxMisses" of them, so that
+        // mistyped names don't accumulate.
+        QSet<QString> misses;
+
+        // The names provided by the sources by prefix.
+        QHash<QString, QList<QString>> completions;
+    };
+
+    // What the sources answered since they were last refreshed. Refreshing replaces the answers
+    // instead of clearing them, and the tables only ever add commands, so that the commands handed
+    // out stay valid as long as the snapshots sharing the answers.
+    struct Answers
+    {
+        std::shared_ptr<const Table> table = std::make_shared<Table>();
+    };
+
+    static constexpr qsizetype MaxMisses = 1024;
+
+    // Guards the sources and the answers. The tables are read with atomic loads and replaced with
+    // atomic stores while it's held.
+    QMutex                                            lock;
+    std::shared_ptr<const std::vector<CommandSource>> sources = std::make_shared<std::vector<CommandSource>>();
+    std::shared_ptr<Answers>                          answers = std::make_shared<Answers>();
+
+    // True once a source is added, so that the lookups don't bother otherwise.
+    std::atomic<bool> available{ false };
+
+    // Watches the paths of the sources.
+    QFileSystemWatcher watcher;
+};
+
+// Snapshot is an immutable version of the commands. Lookups, completions, and hints read the
+// snapshot that is current when they start without waiting for the writers, and the nodes they
+// find stay valid until they release it, even if the commands are modified in the meantime (ex. by
+// the command being invoked).
+struct QConsole::Snapshot
+{
+    Node    root;
+    quint64 generation   = 0;
+    size_t  commandCount = 0;
+
+    // True if the perfect hash tables of the nodes are up to date.
+    bool frozen = false;
+
+    // The answers of the command sources when the snapshot was published.
+    std::shared_ptr<SourceCache::Answers> sources;
+};
+
+// Registry holds the commands and the command sources. Consoles created with the same registry
+// share it and only own their terminal, prompt, and history, so creating a console doesn't copy
+// the commands.
+//
+// The readers use snapshots of the commands that are never modified. The writers are serialized by
+// a lock and modify a tree that shares its children with the snapshots until they are modified,
+// when they are copied. Rather than after every write, a snapshot is published when a reader needs
+// it, so that a burst of writes (ex. registering commands one by one) only copies the children
+// once. A reader that finds the lock taken by a writer uses the previous snapshot and the writer
+// publishes when it's done; the old snapshots are reclaimed when their last reader releases them.
+class QConsole::Registry
+{
+public:
+    Registry()
+      : commands(new Node())
+    {
+        auto snapshot     = std::make_shared<Snapshot>();
+        snapshot->sources = sources.answers;
+        m_published       = std::move(snapshot);
+
+        // Refresh on change notifications instead of asking the sources again on every lookup.
+        QObject::connect(&sources.watcher, &QFileSystemWatcher::directoryChanged, &sources.watcher,
+                         [this]() { refreshSources(); });
+        QObject::connect(&sources.watcher, &QFileSystemWatcher::fileChanged, &sources.watcher,
+                         [this]() { refreshSources(); });
+    }
+
+    ~Registry()
+    {
+        delete commands;
+    }
+
+    // Return the current snapshot of the commands.
+    std::shared_ptr<const Snapshot> snapshot()
+    {
+        auto snapshot = std::atomic_load(&m_published);
+
+        if (snapshot->generation == generation.load(std::memory_order_acquire)) {
+            return snapshot;
+        }
+
+        // A thread always sees its own writes, so it waits for the other writers if it made the
+        // last change; otherwise it doesn't wait.
+        if (s_lastWrite.first == this && s_lastWrite.second > snapshot->generation) {
+            commandsLock.lock();
+        } else if (!commandsLock.tryLock()) {
+            requested.store(true, std::memory_order_relaxed);
+            return snapshot;
+        }
+
+        publish();
+        commandsLock.unlock();
+
+        return std::atomic_load(&m_published);
+    }
+
+    // Publish a snapshot of the commands if they changed since the last one. The caller must hold
+    // the lock.
+    void publish()
+    {
+        const auto current = generation.load(std::memory_order_relaxed);
+
+        if (m_published->generation == current) {
+            return;
+        }
+
+        // The root is copied, and the rest of the tree is shared until it is modified.
+        auto snapshot          = std::make_shared<Snapshot>();
+        snapshot->root         = *commands;
+        snapshot->generation   = current;
+        snapshot->commandCount = commandCount;
+        snapshot->frozen       = frozen && !frozenDirty;
+
+        {
+            QMutexLocker locker(&sources.lock);
+            snapshot->sources = sources.answers;
+        }
+
+        std::atomic_store(&m_published, std::shared_ptr<const Snapshot>(std::move(snapshot)));
+    }
+
+    // Record a change of the commands. The caller must hold the lock.
+    void changed()
+    {
+        s_lastWrite = { this, ++generation };
+
+        if (requested.exchange(false)) {
+            publish();
+        }
+    }
+
+    // Drop what the command sources answered so far.
+    void refreshSources()
+    {
+        QMutexLocker locker(&commandsLock);
+
+        {
+            QMutexLocker sourceLocker(&sources.lock);
+            sources.answers = std::make_shared<SourceCache::Answers>();
+        }
+
+        changed();
+    }
+
+    // Record that the children of the groups on the path of the command changed, so that their
+    // perfect hash tables are rebuilt before the next lookup. The caller must hold the lock.
+    void invalidateTables(std::string_view name)
+    {
+        for (size_t end = 0; end != std::string_view::npos; end = name.find(' ', end + 1)) {
+            invalidateTable(name.substr(0, end));
+        }
+    }
+
+    // Same as "invalidateTables" for the group with the specified path only.
+    void invalidateTable(std::string_view path)
+    {
+        if (frozen) {
+            dirtyGroups.insert(std::string(path));
+            frozenDirty = true;
+        }
+    }
+
+    // Return the group with the specified path in the tree modified by the writers, or null. The
+    // children on the path are not detached. The caller must hold the lock.
+    Node* findGroup(std::string_view path)
+    {
+        Node*  node  = commands;
+        size_t start = 0;
+
+        while (node != nullptr && start < path.size()) {
+            auto end = path.find(' ', start);
+
+            if (end == std::string_view::npos) {
+                end = path.size();
+            }
+
+            if (!node->children) {
+                return nullptr;
+            }
+
+            const auto iter = node->children->find_ks(path.data() + start, end - start);
+
+            node  = iter != node->children->end() ? &iter.value() : nullptr;
+            start = end + 1;
+        }
+
+        return node;
+    }
+
+    // The tree modified by the writers.
+    Node*       commands;
+    size_t      commandCount = 0;
+    SourceCache sources;
+
+    // Serializes the writers and the publication of the snapshots.
+    QMutex commandsLock;
+
+    // Guards the parts of the nodes that the readers build on demand (the fuzzy completion indexes)
+    // while the writers copy the nodes.
+    QMutex lazyLock;
+
+    // Incremented whenever the commands change.
+    std::atomic<quint64> generation{ 0 };
+
+    // Set by the readers that couldn't publish a snapshot because a writer held the lock.
+    std::atomic<bool> requested{ false };
+
+    // True if the lookups use the perfect hash tables, and if some of the tables must be rebuilt
+    // first: those of the groups whose children changed since, by path.
+    bool                            frozen = false;
+    std::atomic<bool>               frozenDirty{ false };
+    std::unordered_set<std::string> dirtyGroups;
+
+private:
+    std::shared_ptr<const Snapshot> m_published;
+
+    // The registry and the generation of the last change made by the thread.
+    static thread_local std::pair<const Registry*, quint64> s_lastWrite;
+};
+
+thread_local std::pair<const QConsole::Registry*, quint64> QConsole::Registry::s_lastWrite;
+
+// Operator separates the commands of a line: "a | b" pipes the output of a into b, "a && b" runs b
+// if a succeeded, "a ; b" runs b after a, and "a & b" runs a in the background.
+struct QConsole::Operator
+{
+    enum Kind
+    {
+        Pipe,
+        And,
+        Sequence,
+        Background,
+    };
+
+    // The index of the first token following the operator.
+    size_t index;
+    Kind   kind;
+
+    static const char* text(Kind kind)
+    {
+        static const char* texts[] = { "|", "&&", ";", "&" };
+        return texts[kind];
+    }
+};
+
+// Tokenizer splits a line into whitespace separated tokens. Single quotes, double quotes, and
+// backslash escapes are resolved in place, so the tokens borrow the tokenizer's line buffer which
+// is reused from one line to the next. Unquoted operators separate the commands of the line.
+class QConsole::Tokenizer
+{
+public:
+    // Tokenize the line. Returns false if a quote isn't terminated.
+    bool tokenize(std::string_view line)
+    {
+        m_buffer.assign(line.data(), line.size());
+        m_tokens.clear();
+        m_operators.clear();
+
+        const auto isSpace = [](char c) {
+            return c == ' ' || c == '\t';
+        };
+
+        char*  data = m_buffer.data();
+        size_t size = m_buffer.size();
+        size_t r    = 0;
+        size_t w    = 0;
+
+        // Unquoting and unescaping never make a token longer, so the write position never
+        // overtakes the read position.
+        while (r < size) {
+            while (r < size && isSpace(data[r])) {
+                r++;
+            }
+
+            if (r == size) {
+                break;
+            }
+
+            if (isOperator(data[r])) {
+                auto kind = Operator::Pipe;
+
+                if (data[r] == '&') {
+                    kind = r + 1 < size && data[r + 1] == '&' ? Operator::And : Operator::Background;
+                } else if (data[r] == ';') {
+                    kind = Operator::Sequence;
+                }
+
+                m_operators.push_back({ m_tokens.size(), kind });
+                r += kind == Operator::And ? 2 : 1;
+                continue;
+            }
+
+            size_t start = w;
+            char   quote = 0;
+
+            while (r < size) {
+                const char c = data[r];
+
+                if (quote == 0 && (isSpace(c) || isOperator(c))) {
+                    break;
+                }
+
+                if (quote == 0 && (c == '"' || c == '\'')) {
+                    quote = c;
+                    r++;
+                } else if (quote != 0 && c == quote) {
+                    quote = 0;
+                    r++;
+                } else if (c == '\\' && quote != '\'' && r + 1 < size) {
+                    data[w++] = data[r + 1];
+                    r += 2;
+                } else {
+                    data[w++] = c;
+                    r++;
+                }
+            }
+
+            if (quote != 0) {
+                return false;
+            }
+
+            m_tokens.emplace_back(data + start, w - start);
+        }
+
+        return true;
+    }
+
+    // The tokens of the last line.
+    const std::vector<std::string_view>& tokens() const
+    {
+        return m_tokens;
+    }
+
+    // The operators of the last line, in order.
+    const std::vector<Operator>& operators() const
+    {
+        return m_operators;
+    }
+
+    static bool isOperator(char c)
+    {
+        return c == '|' || c == '&' || c == ';';
+    }
+
+private:
+    std::string                   m_buffer;
+    std::vector<std::string_view> m_tokens;
+    std::vector<Operator>         m_operators;
+};
+
+// Highlighter splits a line into tokens the way the tokenizer does and colors them. The tokens are
+// kept in a gap buffer around the last edit: the tokens before the gap are positioned from the start
+// of the line and those after it from the end, so an edit only moves the gap, lexes and colors the
+// tokens it touches, and the tokens after it are reused without being shifted. Token positions are
+// counted in code points, as the colors are.
+class QConsole::Highlighter
+{
+public:
+    enum class Kind
+    {
+        Word,
+        String,
+        Number,
+        Flag,
+        Operator,
+    };
+
+    struct Token
+    {
+        // The byte range of the token in the line. After the gap, the distances from the end of the
+        // line to the start and to the end of the token.
+        size_t start;
+        size_t end;
+
+        // The code point range of the token in the line. After the gap, the position is the
+        // distance from the end of the line to the start of the token.
+        int position;
+        int length;
+
+        Kind kind;
+
+        // The color of the token, and the node the words descend from before and after it. A null
+        // node stands for the arguments.
+        Replxx::Color color;
+        const Node*   state;
+        const Node*   next;
+    };
+
+    // Color the tokens of the line: the words naming a command or a group as long as they descend
+    // the tree, then the arguments by kind. Each command of the line starts over from the root.
+    void colorize(QConsole& console, std::string_view input, Replxx::colors_t& colors)
+    {
+        auto first = update(input);
+        auto state = first > 0 ? m_before[first - 1].next : nullptr;
+
+        // The nodes of the tokens belong to the snapshot they were colored with, and the names
+        // provided by the command sources depend on what they answered since.
+        auto       snapshot = console.m_registry->snapshot();
+        auto       sources  = std::atomic_load(&snapshot->sources->table);
+        const bool recolor  = snapshot != m_snapshot || sources != m_sources;
+
+        m_snapshot = std::move(snapshot);
+        m_sources  = std::move(sources);
+
+        if (recolor || first == 0) {
+            first = 0;
+            state = &m_snapshot->root;
+        }
+
+        for (auto k = first; k < m_before.size(); ++k) {
+            auto& token = m_before[k];
+
+            state = color(console, input.substr(token.start, token.end - token.start), token, state);
+        }
+
+        // The tokens after the edit are colored again until one is entered in the same state as
+        // before, since the following ones are then colored the same.
+        for (auto k = m_after.size(); k > 0; --k) {
+            auto& token = m_after[k - 1];
+
+            if (!recolor && token.state == state) {
+                break;
+            }
+
+            state = color(console, input.substr(input.size() - token.start, token.start - token.end), token, state);
+        }
+
+        // Replxx passes new colors for each line, so the colors of all the tokens are copied.
+        for (const auto& token : m_before) {
+            fill(colors, token.position, token.length, token.color);
+        }
+
+        for (const auto& token : m_after) {
+            fill(colors, m_codePoints - token.position, token.length, token.color);
+        }
+    }
+
+private:
+    // Update the tokens for the new line. Returns the index of the first token lexed again.
+    size_t update(std::string_view line)
+    {
+        const auto oldSize  = m_line.size();
+        const auto oldCount = m_codePoints;
+        const auto limit    = std::min(oldSize, line.size());
+        const auto prefix   = commonPrefix(m_line.data(), line.data(), limit);
+        const auto suffix   = commonSuffix(m_line.data() + oldSize, line.data() + line.size(), limit - prefix);
+
+        // Move the gap to the edit: the tokens ending before it stay before the gap. A token ending
+        // right at the edit may be extended.
+        while (!m_before.empty() && m_before.back().end >= prefix) {
+            m_after.push_back(flip(m_before.back(), oldSize, oldCount));
+            m_before.pop_back();
+        }
+
+        while (!m_after.empty() && oldSize - m_after.back().end < prefix) {
+            m_before.push_back(flip(m_after.back(), oldSize, oldCount));
+            m_after.pop_back();
+        }
+
+        // Code points are counted by their leading bytes, so an edit splitting one is counted right.
+        const auto removed  = std::string_view(m_line).substr(prefix, oldSize - prefix - suffix);
+        const auto inserted = line.substr(prefix, line.size() - prefix - suffix);
+
+        m_codePoints = oldCount - codePointCount(removed) + codePointCount(inserted);
+
+        const auto first    = m_before.size();
+        size_t     i        = first > 0 ? m_before.back().end : 0;
+        int        position = first > 0 ? m_before.back().position + m_before.back().length : 0;
+
+        Token token{};
+        bool  resynchronized = false;
+
+        while (next(line, i, position, token)) {
+            const auto distance = line.size() - token.start;
+
+            // The old tokens starting in the unchanged suffix are at the same distance from the end.
+            while (!m_after.empty() && (m_after.back().start > suffix || m_after.back().start > distance)) {
+                m_after.pop_back();
+            }
+
+            // Lexing from the same state over the same text gives the same tokens, so the rest of
+            // the old tokens can be reused.
+            if (!m_after.empty() && m_after.back().start == distance) {
+                resynchronized = true;
+                break;
+            }
+
+            m_before.push_back(token);
+        }
+
+        if (!resynchronized) {
+            m_after.clear();
+        }
+
+        m_line.replace(prefix, removed.size(), inserted);
+
+        return first;
+    }
+
+    // Move a token across the gap of a line of "size" bytes and "count" code points.
+    static Token flip(Token token, size_t size, int count)
+    {
+        token.start    = size - token.start;
+        token.end      = size - token.end;
+        token.position = count - token.position;
+        return token;
+    }
+
+    // Color the token spelled "word" entered with "state", and return the next state.
+    const Node* color(QConsole& console, std::string_view word, Token& token, const Node* state)
+    {
+        token.state = state;
+        token.color = Replxx::Color::DEFAULT;
+
+        if (token.kind == Kind::Operator) {
+            state = &m_snapshot->root;
+        } else if (state != nullptr) {
+            // The command sources are not asked while typing; the names they weren't asked about
+            // yet are not highlighted as unknown.
+            const auto child = token.kind == Kind::Word ? console.findChild(*m_snapshot, *state, word, false) : nullptr;
+
+            if (child != nullptr) {
+                token.color = Replxx::Color::BRIGHTGREEN;
+            } else if (!state->invokable
+                       && (state != &m_snapshot->root || console.isSourceAnswered(*m_snapshot, word))) {
+                token.color = Replxx::Color::RED;
+            }
+
+            state = child;
+        }
+
+        if (token.color == Replxx::Color::DEFAULT) {
+            switch (token.kind) {
+            case Kind::String:
+                token.color = Replxx::Color::YELLOW;
+                break;
+            case Kind::Number:
+                token.color = Replxx::Color::BRIGHTMAGENTA;
+                break;
+            case Kind::Flag:
+                token.color = Replxx::Color::BRIGHTCYAN;
+                break;
+            case Kind::Operator:
+                token.color = Replxx::Color::BRIGHTBLUE;
+                break;
+            case Kind::Word:
+                break;
+            }
+        }
+
+        token.next = state;
+        return state;
+    }
+
+    static void fill(Replxx::colors_t& colors, int position, int length, Replxx::Color color)
+    {
+        if (color == Replxx::Color::DEFAULT) {
+            return;
+        }
+
+        const auto end = std::min(size_t(position + length), colors.size());
+
+        for (auto k = size_t(position); k < end; ++k) {
+            colors[k] = color;
+        }
+    }
+
+    static size_t commonPrefix(const char* a, const char* b, size_t size)
+    {
+        size_t i = 0;
+
+        while (i + 64 <= size && memcmp(a + i, b + i, 64) == 0) {
+            i += 64;
+        }
+
+        while (i < size && a[i] == b[i]) {
+            i++;
+        }
+
+        return i;
+    }
+
+    // Same as "commonPrefix" but backwards from the ends of the strings.
+    static size_t commonSuffix(const char* a, const char* b, size_t size)
+    {
+        size_t i = 0;
+
+        while (i + 64 <= size && memcmp(a - i - 64, b - i - 64, 64) == 0) {
+            i += 64;
+        }
+
+        while (i < size && a[-ptrdiff_t(i) - 1] == b[-ptrdiff_t(i) - 1]) {
+            i++;
+        }
+
+        return i;
+    }
+
+    // Lex the next token starting at or after "i". Returns false at the end of the line.
+    static bool next(std::string_view line, size_t& i, int& position, Token& token)
+    {
+        while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) {
+            i++;
+            position++;
+        }
+
+        if (i == line.size()) {
+            return false;
+        }
+
+        token.start    = i;
+        token.position = position;
+
+        if (Tokenizer::isOperator(line[i])) {
+            const size_t length = line[i] == '&' && i + 1 < line.size() && line[i + 1] == '&' ? 2 : 1;
+
+            token.end    = i += length;
+            token.length = int(length);
+            token.kind   = Kind::Operator;
+            position += int(length);
+            return true;
+        }
+
+        char quote   = 0;
+        bool quoted  = false;
+        bool escaped = false;
+
+        for (; i < line.size(); ++i) {
+            const char c = line[i];
+
+            if (escaped) {
+                escaped = false;
+            } else if (quote != 0) {
+                quote   = c == quote ? 0 : quote;
+                escaped = c == '\\' && quote == '"';
+            } else if (c == ' ' || c == '\t' || Tokenizer::isOperator(c)) {
+                break;
+            } else if (c == '"' || c == '\'') {
+                quote  = c;
+                quoted = true;
+            } else {
+                escaped = c == '\\';
+            }
+
+            position += (static_cast<unsigned char>(c) & 0xC0) != 0x80;
+        }
+
+        token.end    = i;
+        token.length = position - token.position;
+        token.kind   = quoted ? Kind::String : classify(line.substr(token.start, token.end - token.start));
+
+        return true;
+    }
+
+    static Kind classify(std::string_view word)
+    {
+        size_t i      = word[0] == '-' || word[0] == '+' ? 1 : 0;
+        size_t digits = 0;
+        bool   dot    = false;
+
+        for (; i < word.size(); ++i) {
+            if (word[i] >= '0' && word[i] <= '9') {
+                digits++;
+            } else if (word[i] == '.' && !dot) {
+                dot = true;
+            } else {
+                break;
+            }
+        }
+
+        if (i == word.size() && digits > 0) {
+            return Kind::Number;
+        }
+
+        return word[0] == '-' && word.size() > 1 ? Kind::Flag : Kind::Word;
+    }
+
+    std::string                     m_line;
+    int                             m_codePoints = 0;
+    std::vector<Token>              m_before;
+    std::vector<Token>              m_after;
+    std::shared_ptr<const Snapshot> m_snapshot;
+    std::shared_ptr<const SourceCache::Table> m_sources;
+};
+
+// Invocation holds the state of an asynchronous command until it is finished. The arguments are
+// copied since the line they are borrowed from is reused once the command is started.
+struct QConsole::Invocation
+{
+    Invocation(const Arguments& arguments, QConsole* console)
+      : buffer(concatenate(arguments))
+      , views(split(buffer, arguments))
+      , stream(&output)
+      , context{ Arguments(views.data(), views.size()), &stream, console }
+    {
+    }
+
+    static std::string concatenate(const Arguments& arguments)
+    {
+        std::string buffer;
+
+        for (const auto& a : arguments) {
+            buffer.append(a);
+        }
+
+        return buffer;
+    }
+
+    static std::vector<std::string_view> split(const std::string& buffer, const Arguments& arguments)
+    {
+        std::vector<std::string_view> views;
+        size_t                        offset = 0;
+
+        for (const auto& a : arguments) {
+            views.emplace_back(buffer.data() + offset, a.size());
+            offset += a.size();
+        }
+
+        return views;
+    }
+
+    std::string                   buffer;
+    std::vector<std::string_view> views;
+    QString                       output;
+    QTextStream                   stream;
+    Context                       context;
+};
+
+// Statistics records the invocations of a command in a log-linear histogram of their latencies: the
+// values below 32 ns have a bucket each, and every power of two above is split into 16 buckets, so
+// that recording a latency only takes a few instructions and the percentiles are accurate to 1/16.
+// The counters are atomic since background jobs and pipelines record from their own threads.
+struct QConsole::Statistics
+{
+    static constexpr int SubBuckets = 16;
+    static constexpr int Exponents  = 36;
+    static constexpr int Buckets    = 2 * SubBuckets + Exponents * SubBuckets;
+
+    std::atomic<quint64>                      invocations{ 0 };
+    std::atomic<quint64>                      errors{ 0 };
+    std::atomic<qint64>                       max{ 0 };
+    std::array<std::atomic<quint64>, Buckets> counts{};
+
+    void record(const QElapsedTimer& timer, bool failed)
+    {
+        record(timer.nsecsElapsed(), failed);
+    }
+
+    void record(qint64 nanoseconds, bool failed)
+    {
+        invocations.fetch_add(1, std::memory_order_relaxed);
+        errors.fetch_add(failed, std::memory_order_relaxed);
+        counts[bucket(quint64(std::max(nanoseconds, qint64(0))))].fetch_add(1, std::memory_order_relaxed);
+
+        for (auto m = max.load(std::memory_order_relaxed); m < nanoseconds;) {
+            if (max.compare_exchange_weak(m, nanoseconds, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+    }
+
+    void reset()
+    {
+        invocations.store(0, std::memory_order_relaxed);
+        errors.store(0, std::memory_order_relaxed);
+        max.store(0, std::memory_order_relaxed);
+
+        for (auto& count : counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Return the highest latency of the bucket holding the specified fraction of the invocations.
+    qint64 percentile(double fraction) const
+    {
+        const auto target = std::max(quint64(1), quint64(std::ceil(fraction * double(invocations.load()))));
+        quint64    count  = 0;
+
+        for (int i = 0; i < Buckets; ++i) {
+            if ((count += counts[i].load(std::memory_order_relaxed)) >= target) {
+                return std::min(highest(i), max.load());
+            }
+        }
+
+        return max;
+    }
+
+    static int bucket(quint64 value)
+    {
+        if (value < 2 * SubBuckets) {
+            return int(value);
+        }
+
+        const auto exponent = 63 - int(qCountLeadingZeroBits(value));
+
+        if (exponent >= 5 + Exponents) {
+            return Buckets - 1;
+        }
+
+        return 2 * SubBuckets + (exponent - 5) * SubBuckets + int((value >> (exponent - 4)) & (SubBuckets - 1));
+    }
+
+    static qint64 highest(int bucket)
+    {
+        if (bucket < 2 * SubBuckets) {
+            return bucket;
+        }
+
+        const auto exponent = (bucket - 2 * SubBuckets) / SubBuckets + 5;
+        const auto mantissa = qint64((bucket - 2 * SubBuckets) % SubBuckets);
+
+        return ((SubBuckets + mantissa + 1) << (exponent - 4)) - 1;
+    }
+};
+
+// Pipe streams the output of a command of a pipeline into the input of the next one. The output is
+// appended to a bounded queue of chunks that the next command reads as they fill up, so the commands
+// run concurrently and the producer waits when the consumer falls behind instead of its whole
+// output being buffered. The chunks change hands without being copied.
+class QConsole::Pipe : public QIODevice
+{
+public:
+    static constexpr qint64 ChunkSize = 16 * 1024;
+    static constexpr size_t MaxChunks = 16;
+
+    explicit Pipe(size_t maxChunks = MaxChunks)
+      : m_sink(this)
+      , m_maxChunks(maxChunks)
+    {
+        open(QIODevice::ReadOnly);
+        m_sink.open(QIODevice::WriteOnly);
+    }
+
+    // Return the device the producer writes to.
+    QIODevice* sink()
+    {
+        return &m_sink;
+    }
+
+    // Signal the end of the input once the producer is done.
+    void closeWrite()
+    {
+        QMutexLocker locker(&m_lock);
+
+        m_writeClosed = true;
+        m_readable.wakeAll();
+    }
+
+    // Drop the rest of the output once the consumer is done. The writes of the producer fail from
+    // then on, which it can check with the status of its output stream to stop early.
+    void closeRead()
+    {
+        QMutexLocker locker(&m_lock);
+
+        m_readClosed = true;
+        m_chunks.clear();
+        m_size = 0;
+        m_writable.wakeAll();
+    }
+
+    bool isSequential() const override
+    {
+        return true;
+    }
+
+    qint64 bytesAvailable() const override
+    {
+        QMutexLocker locker(&m_lock);
+
+        return QIODevice::bytesAvailable() + m_size;
+    }
+
+    // Wait for the producer when nothing is left to read, so that the consumers can read until the
+    // end of their input.
+    bool atEnd() const override
+    {
+        if (QIODevice::bytesAvailable() > 0) {
+            return false;
+        }
+
+        QMutexLocker locker(&m_lock);
+
+        while (m_chunks.empty() && !m_writeClosed) {
+            m_readable.wait(&m_lock);
+        }
+
+        return m_chunks.empty();
+    }
+
+protected:
+    qint64 readData(char* data, qint64 maxSize) override
+    {
+        QMutexLocker locker(&m_lock);
+
+        while (m_chunks.empty() && !m_writeClosed) {
+            m_readable.wait(&m_lock);
+        }
+
+        if (m_chunks.empty()) {
+            return -1;
+        }
+
+        const auto& chunk = m_chunks.front();
+        const auto  size  = std::min(maxSize, qint64(chunk.size()) - m_offset);
+
+        memcpy(data, chunk.constData() + m_offset, size_t(size));
+
+        m_offset += size;
+        m_size -= size;
+
+        if (m_offset == chunk.size()) {
+            m_chunks.pop_front();
+            m_offset = 0;
+            m_writable.wakeOne();
+        }
+
+        return size;
+    }
+
+    qint64 writeData(const char* data, qint64 size) override
+    {
+        Q_UNUSED(data);
+        Q_UNUSED(size);
+
+        return -1;
+    }
+
+private:
+    class Sink : public QIODevice
+    {
+    public:
+        explicit Sink(Pipe* pipe)
+          : m_pipe(pipe)
+        {
+        }
+
+        bool isSequential() const override
+        {
+            return true;
+        }
+
+    protected:
+        qint64 readData(char* data, qint64 maxSize) override
+        {
+            Q_UNUSED(data);
+            Q_UNUSED(maxSize);
+
+            return -1;
+        }
+
+        qint64 writeData(const char* data, qint64 size) override
+        {
+            return m_pipe->push(data, size);
+        }
+
+    private:
+        Pipe* m_pipe;
+    };
+
+    // Append the data to the last chunk while it has room, and to new chunks while the queue isn't
+    // full.
+    qint64 push(const char* data, qint64 size)
+    {
+        QMutexLocker locker(&m_lock);
+
+        qint64 written = 0;
+
+        while (written < size) {
+            if (m_readClosed) {
+                return -1;
+            }
+
+            if (m_chunks.empty() || m_chunks.back().size() == ChunkSize) {
+                if (m_chunks.size() == m_maxChunks) {
+                    m_writable.wait(&m_lock);
+                    continue;
+                }
+
+                m_chunks.emplace_back();
+                m_chunks.back().reserve(ChunkSize);
+            }
+
+            auto&      chunk = m_chunks.back();
+            const auto count = std::min(size - written, ChunkSize - qint64(chunk.size()));
+
+            chunk.append(data + written, qsizetype(count));
+
+            written += count;
+            m_size += count;
+        }
+
+        m_readable.wakeOne();
+
+        return written;
+    }
+
+    Sink   m_sink;
+    size_t m_maxChunks;
+
+    mutable QMutex         m_lock;
+    mutable QWaitCondition m_readable;
+    QWaitCondition         m_writable;
+    std::deque<QByteArray> m_chunks;
+    qint64                 m_offset      = 0;
+    qint64                 m_size        = 0;
+    bool                   m_writeClosed = false;
+    bool                   m_readClosed  = false;
+};
+
+// Job is a list of commands run in the background with "&" (ex. "scan a && scan b &"). The commands
+// run one after the other on the job thread pool and their output is buffered until each of them is
+// finished, then printed in one piece so that it doesn't tear the prompt. The tokens are copied
+// since the line they are borrowed from is reused once the job is started.
+struct QConsole::Job
+{
+    enum class State
+    {
+        Queued,
+        Running,
+        Done,
+        Failed,
+        Killed,
+    };
+
+    // Output buffers the output of the job. Its writes fail once the job is killed, which the
+    // commands can check with the status of their output stream to stop early.
+    class Output : public QIODevice
+    {
+    public:
+        explicit Output(const std::atomic<bool>& killed)
+          : m_killed(killed)
+        {
+            open(QIODevice::WriteOnly);
+        }
+
+        QByteArray take()
+        {
+            return std::exchange(m_buffer, QByteArray());
+        }
+
+    protected:
+        qint64 readData(char* data, qint64 size) override
+        {
+            Q_UNUSED(data);
+            Q_UNUSED(size);
+            return -1;
+        }
+
+        qint64 writeData(const char* data, qint64 size) override
+        {
+            if (m_killed.load(std::memory_order_relaxed)) {
+                return -1;
+            }
+
+            m_buffer.append(data, size);
+            return size;
+        }
+
+    private:
+        const std::atomic<bool>& m_killed;
+        QByteArray               m_buffer;
+    };
+
+    Job(int id, const Arguments& tokens, std::vector<Operator> operators)
+      : id(id)
+      , buffer(Invocation::concatenate(tokens))
+      , tokens(Invocation::split(buffer, tokens))
+      , operators(std::move(operators))
+      , output(killed)
+      , stream(&output)
+    {
+        for (size_t i = 0, k = 0; i < this->tokens.size(); ++i) {
+            for (; k < this->operators.size() && this->operators[k].index == i; ++k) {
+                line.append(' ').append(QLatin1String(Operator::text(this->operators[k].kind)));
+            }
+
+            if (!line.isEmpty()) {
+                line.append(' ');
+            }
+
+            line.append(QString::fromUtf8(this->tokens[i].data(), qsizetype(this->tokens[i].size())));
+        }
+
+        promise.start();
+        future = promise.future();
+    }
+
+    static QString name(State state)
+    {
+        static const char* names[] = { "Queued", "Running", "Done", "Failed", "Killed" };
+        return QLatin1String(names[int(state)]);
+    }
+
+    // Print the output buffered so far, to the session that started the job if any.
+    void flush(QConsole& console)
+    {
+        stream.flush();
+
+        if (const auto text = output.take(); !text.isEmpty()) {
+            send(console, QString::fromUtf8(text));
+        }
+    }
+
+    void send(QConsole& console, const QString& text)
+    {
+        if (!remote) {
+            console.print(text);
+            return;
+        }
+
+        QMetaObject::invokeMethod(
+          &console,
+          [device = *remote, text]() {
+              if (device != nullptr && device->isOpen()) {
+                  device->write(text.toUtf8());
+              }
+          },
+          Qt::QueuedConnection);
+    }
+
+    const int                     id;
+    QString                       line;
+    std::string                   buffer;
+    std::vector<std::string_view> tokens;
+    std::vector<Operator>         operators;
+
+    std::atomic<bool> killed{ false };
+    Output            output;
+    QTextStream       stream;
+
+    // The state is guarded by the lock since the jobs are listed from the console thread.
+    QMutex lock;
+    State  state = State::Queued;
+
+    // The future is finished once the job is.
+    QPromise<void> promise;
+    QFuture<void>  future;
+
+    // The session that started the job, if any. The output is sent to its socket and the commands
+    // run on the console thread are invoked for it.
+    std::optional<QPointer<QIODevice>> remote;
+    std::weak_ptr<Session>             session;
+};
+
+// Suspension holds the rest of a line waiting for asynchronous commands or jobs (ex. "fetch &&
+// parse" or "wait; report"). The tokens following the command are copied, since the tokenizer
+// moves on to the next line, and evaluated once the futures are finished; then "resume" is called
+// so that the input the line came from goes on.
+struct QConsole::Suspension
+{
+    Suspension(const std::string_view* tokens, size_t size, const Operator* operators, size_t count, size_t first)
+      : buffer(Invocation::concatenate(rest(tokens, size, operators, count, first)))
+      , tokens(Invocation::split(buffer, rest(tokens, size, operators, count, first)))
+      , operators(operators + first, operators + count)
+    {
+        const auto begin = first < count ? operators[first].index : size;
+
+        for (auto& op : this->operators) {
+            op.index -= begin;
+        }
+    }
+
+    static Arguments rest(const std::string_view* tokens, size_t size, const Operator* operators, size_t count,
+                          size_t first)
+    {
+        const auto begin = first < count ? operators[first].index : size;
+        return Arguments(tokens + begin, qsizetype(size - begin));
+    }
+
+    std::string                   buffer;
+    std::vector<std::string_view> tokens;
+    std::vector<Operator>         operators;
+
+    // The futures left to wait for, and whether the ones finished so far succeeded.
+    std::vector<QFuture<void>> futures;
+    bool                       succeeded = true;
+
+    // The stream and the session the line was evaluated for.
+    QTextStream*             output = nullptr;
+    std::shared_ptr<Session> session;
+
+    std::function<void()> resume;
+};
+
+// Pager shows the output of a command one page at a time, like "more". The lines are read as the
+// pages are shown, so the command only gets ahead by what fits in the pipe between them and stops
+// when the user quits, once the pipe is closed. The keys are read from stdin without waiting for a
+// new line; the console thread is blocked in the meantime, as it is by "readLine".
+class QConsole::Pager
+{
+public:
+    Pager(QIODevice& input, QTextStream& out)
+      : m_input(input)
+      , m_out(out)
+    {
+    }
+
+    // Show the input until its end or until the user quits: space shows the next page, enter the
+    // next line, "/" skips to the next line containing a text and "n" to the next one again.
+    void run()
+    {
+        const auto [rows, columns] = terminalSize();
+        const auto page            = std::max(rows - 1, 1);
+
+        int        left = page;
+        QByteArray pattern;
+        QString    status;
+
+#ifndef Q_OS_WIN32
+        // The keys are read without waiting for a new line or echoing them until the pager returns.
+        termios    saved;
+        const bool terminal = tcgetattr(STDIN_FILENO, &saved) == 0;
+
+        if (terminal) {
+            termios raw = saved;
+
+            raw.c_lflag &= ~tcflag_t(ICANON | ECHO);
+            raw.c_cc[VMIN]  = 1;
+            raw.c_cc[VTIME] = 0;
+
+            tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+        }
+
+        const auto restore = qScopeGuard([terminal, &saved]() {
+            if (terminal) {
+                tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+            }
+        });
+#endif
+
+        // A search that failed at the end of the input still shows its status before the pager returns.
+        while (!m_pending.isEmpty() || !m_input.atEnd() || !status.isEmpty()) {
+            if (left > 0) {
+                const auto line = m_pending.isEmpty() ? m_input.readLine() : std::exchange(m_pending, QByteArray());
+
+                m_out << QString::fromUtf8(line);
+                left -= rowCount(line, columns);
+                continue;
+            }
+
+            m_out << "\33[7m--More--\33[0m";
+
+            // The result of the last search is shown on the status line until the next key.
+            if (!status.isEmpty()) {
+                m_out << ' ' << QConsole::colorize(std::exchange(status, QString()), QConsole::Color::Red,
+                                                   QConsole::Style::Normal);
+            }
+
+            m_out << Qt::flush;
+
+            const auto key = readKey();
+
+            m_out << "\r\33[K";
+
+            if (key == ' ' || key == 'f') {
+                left = page;
+            } else if (key == '\r' || key == '\n' || key == 'j') {
+                left = 1;
+            } else if (key == '/' || key == 'n') {
+                if (key == '/') {
+                    pattern = readPattern();
+                }
+
+                if (pattern.isEmpty()) {
+                    continue;
+                }
+
+                if (!skipTo(pattern)) {
+                    status = QStringLiteral("Pattern not found");
+                    left   = 0;
+                    continue;
+                }
+
+                m_out << "...skipping\n";
+                left = page - 1;
+            } else if (key == 'q' || key == 'Q' || key == 4 || key < 0) {
+                break;
+            }
+        }
+
+        m_out.flush();
+    }
+
+private:
+    // Skip to the first line containing the pattern, which is shown first on the next page. As in
+    // "more", the lines skipped aren't kept, so a search matching nothing goes on paging from the end
+    // of the input. A key pressed while searching stops the search where it is, in case the command
+    // doesn't end.
+    bool skipTo(const QByteArray& pattern)
+    {
+        if (strip(m_pending).contains(pattern)) {
+            return true;
+        }
+
+        m_pending.clear();
+
+        for (qint64 count = 1; !m_input.atEnd(); ++count) {
+            auto line = m_input.readLine();
+
+            if (strip(line).contains(pattern)) {
+                m_pending = std::move(line);
+                return true;
+            }
+
+            if (count % 1024 == 0 && keyPressed()) {
+                readKey();
+                break;
+            }
+        }
+
+        return false;
+    }
+
+    // Read the text to search for after a slash. Returns an empty text if the search is canceled
+    // with escape.
+    QByteArray readPattern()
+    {
+        QByteArray pattern;
+
+        m_out << "/" << Qt::flush;
+
+        for (int key; (key = readKey()) >= 0 && key != '\r' && key != '\n';) {
+            if (key == 27) {
+                pattern.clear();
+                break;
+            }
+
+            if (key == 127 || key == 8) {
+                while (!pattern.isEmpty() && (pattern.back() & 0xC0) == 0x80) {
+                    pattern.chop(1);
+                }
+
+                pattern.chop(1);
+            } else {
+                pattern.append(char(key));
+            }
+
+            m_out << "\r\33[K/" << QString::fromUtf8(pattern) << Qt::flush;
+        }
+
+        m_out << "\r\33[K";
+
+        return pattern;
+    }
+
+    // Return the line without its colors.
+    static QByteArray strip(const QByteArray& line)
+    {
+        QByteArray text;
+        text.reserve(line.size());
+
+        for (qsizetype i = 0; i < line.size(); ++i) {
+            if (line[i] == '\33' && i + 1 < line.size() && line[i + 1] == '[') {
+                for (i += 2; i < line.size() && line[i] != 'm'; ++i) {
+                }
+            } else {
+                text.append(line[i]);
+            }
+        }
+
+        return text;
+    }
+
+    // Return the number of rows the line takes on the terminal once wrapped.
+    static int rowCount(const QByteArray& line, int columns)
+    {
+        const auto text  = strip(line);
+        const auto width = codePointCount(std::string_view(text.constData(), size_t(text.size())))
+                         - int(text.endsWith('\n'));
+
+        return std::max(1, (width + columns - 1) / columns);
+    }
+
+    // Read a key from stdin, which "run" switched to raw mode. Returns -1 at the end of the input.
+    static int readKey()
+    {
+#ifdef Q_OS_WIN32
+        return _getch();
+#else
+        unsigned char c = 0;
+        ssize_t       n = 0;
+
+        // Resizing the terminal interrupts the read.
+        while ((n = ::read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR) {
+        }
+
+        return n == 1 ? c : -1;
+#endif
+    }
+
+    // Return true if a key can be read from stdin without waiting.
+    static bool keyPressed()
+    {
+#ifdef Q_OS_WIN32
+        return _kbhit() != 0;
+#else
+        pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+
+        return ::poll(&fd, 1, 0) > 0;
+#endif
+    }
+
+    // Return the number of rows and columns of the terminal.
+    static std::pair<int, int> terminalSize()
+    {
+#ifdef Q_OS_WIN32
+        CONSOLE_SCREEN_BUFFER_INFO info;
+
+        if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
+            return { info.srWindow.Bottom - info.srWindow.Top + 1, info.srWindow.Right - info.srWindow.Left + 1 };
+        }
+#else
+        winsize size;
+
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_row > 0 && size.ws_col > 0) {
+            return { size.ws_row, size.ws_col };
+        }
+#endif
+
+        return { 24, 80 };
+    }
+
+    QIODevice&   m_input;
+    QTextStream& m_out;
+    QByteArray   m_pending;
+};
+
+// Reader reads user input on a dedicated thread so that the console thread is free to process
+// events while the user is typing. Only one line is read at a time: the reader waits until the
+// console thread has evaluated the previous line and requested the next one.
+class QConsole::Reader : public QThread
+{
+public:
+    explicit Reader(QConsole* console)
+      : m_console(console)
+      , m_reading(false)
+      , m_interrupted(false)
+    {
+    }
+
+    // Read the next line using the specified prompt.
+    void requestLine(const std::string& prompt)
+    {
+        m_prompt = prompt;
+        m_ready.release();
+    }
+
+    // Stop reading user input. The line currently being edited is discarded.
+    void interrupt()
+    {
+        m_interrupted = true;
+        m_ready.release();
+
+        // Abort the current read, if any.
+        if (m_reading) {
+            m_console->m_terminal->emulate_key_press(Replxx::KEY::control('C'));
+        }
+    }
+
+protected:
+    void run() override
+    {
+        for (;;) {
+            m_ready.acquire();
+            m_reading = true;
+
+            if (m_interrupted) {
+                return;
+            }
+
+            const auto input = m_console->m_terminal->input(m_prompt);
+            m_reading        = false;
+
+            if (m_interrupted) {
+                return;
+            }
+
+            // Handle EOF (ctrl+d)
+            if (input == nullptr) {
+                QMetaObject::invokeMethod(
+                  QCoreApplication::instance(), []() { QCoreApplication::quit(); }, Qt::QueuedConnection);
+                return;
+            }
+
+            QMetaObject::invokeMethod(
+              m_console,
+              [console = m_console, line = std::string(input)]() {
+                  // The next line is read once the line is evaluated, even if it waits for commands.
+                  if (const auto suspension = console->evaluateLine(line); suspension != nullptr) {
+                      suspension->resume = [console]() { console->readNextLine(); };
+                  } else {
+                      console->readNextLine();
+                  }
+              },
+              Qt::QueuedConnection);
+        }
+    }
+
+private:
+    QConsole*        m_console;
+    QSemaphore       m_ready;
+    std::string      m_prompt;
+    std::atomic_bool m_reading;
+    std::atomic_bool m_interrupted;
+};
+
+// HistoryIndex mirrors the history with a trigram index so that searching it doesn't scan every
+// entry. Each trigram maps to the ascending list of the entries containing it, and a search only
+// checks the entries found in the lists of every trigram of the pattern (or of the longest literal
+// a regular expression requires). Entries replaced by a duplicate or dropped from the history are
+// marked as removed, and swept once they outnumber the others.
+class QConsole::HistoryIndex
+{
+public:
+    struct Entry
+    {
+        std::string timestamp;
+        std::string text;
+    };
+
+    void clear()
+    {
+        m_entries.clear();
+        m_live.clear();
+        m_postings.clear();
+        m_ids.clear();
+        m_first   = 0;
+        m_count   = 0;
+        m_removed = 0;
+    }
+
+    void setMaxSize(int size)
+    {
+        m_maxSize = size_t(std::max(size, 0));
+        trim();
+    }
+
+    void setUnique(bool unique)
+    {
+        m_unique = unique;
+    }
+
+    void add(std::string timestamp, std::string text)
+    {
+        if (const auto iter = m_ids.find(text); m_unique && iter != m_ids.end()) {
+            remove(iter->second);
+        }
+
+        insert(Entry{ std::move(timestamp), std::move(text) });
+        trim();
+    }
+
+    // Call "match" with the position of each entry matching the pattern and the entry, oldest first,
+    // until it returns false. Returns false if the pattern is an invalid regular expression.
+    bool search(std::string_view pattern, bool regex, const std::function<bool(qsizetype, const Entry&)>& match)
+    {
+        QRegularExpression expression;
+        std::string        literal(pattern);
+
+        if (regex) {
+            expression.setPattern(QString::fromUtf8(pattern.data(), qsizetype(pattern.size())));
+
+            if (!expression.isValid()) {
+                return false;
+            }
+
+            literal = requiredLiteral(pattern);
+        }
+
+        const auto accept = [&](const std::string& text) {
+            return regex ? expression.match(QString::fromStdString(text)).hasMatch()
+                         : text.find(literal) != std::string::npos;
+        };
+
+        qsizetype position = 0;
+        size_t    counted  = m_first;
+
+        // Count the entries before each match as the matches are found in ascending order.
+        const auto report = [&](size_t id) {
+            position += countLive(counted, id);
+            counted = id;
+            return match(position, m_entries[id]);
+        };
+
+        // Patterns shorter than a trigram are checked against every entry.
+        if (literal.size() < 3) {
+            for (size_t id = m_first; id < m_entries.size(); ++id) {
+                if (isLive(id) && accept(m_entries[id].text) && !report(id)) {
+                    break;
+                }
+            }
+
+            return true;
+        }
+
+        std::vector<const std::vector<quint32>*> lists;
+
+        trigrams(literal, m_trigrams);
+
+        for (const auto trigram : m_trigrams) {
+            const auto iter = m_postings.find(trigram);
+
+            if (iter == m_postings.end()) {
+                return true;
+            }
+
+            lists.push_back(&iter->second);
+        }
+
+        // Intersect the lists, starting from the shortest one.
+        std::sort(lists.begin(), lists.end(), [](auto a, auto b) { return a->size() < b->size(); });
+
+        for (const auto id : *lists.front()) {
+            const auto found = isLive(id) && std::all_of(lists.begin() + 1, lists.end(), [id](auto list) {
+                return std::binary_search(list->begin(), list->end(), id);
+            });
+
+            if (found && accept(m_entries[id].text) && !report(id)) {
+                break;
+            }
+        }
+
+        return true;
+    }
+
+private:
+    void insert(Entry&& entry)
+    {
+        const auto id = quint32(m_entries.size());
+
+        trigrams(entry.text, m_trigrams);
+
+        for (const auto trigram : m_trigrams) {
+            m_postings[trigram].push_back(id);
+        }
+
+        if (id % 64 == 0) {
+            m_live.push_back(0);
+        }
+
+        m_live.back() |= quint64(1) << (id % 64);
+        m_ids[entry.text] = id;
+        m_count++;
+
+        m_entries.push_back(std::move(entry));
+    }
+
+    void remove(size_t id)
+    {
+        if (const auto iter = m_ids.find(m_entries[id].text); iter != m_ids.end() && iter->second == id) {
+            m_ids.erase(iter);
+        }
+
+        m_live[id / 64] &= ~(quint64(1) << (id % 64));
+        m_count--;
+        m_removed++;
+
+        if (m_removed > m_count && m_removed > 1024) {
+            sweep();
+        }
+    }
+
+    // Drop the oldest entries past the maximum size of the history.
+    void trim()
+    {
+        while (m_count > m_maxSize) {
+            while (!isLive(m_first)) {
+                m_first++;
+            }
+
+            remove(m_first);
+        }
+    }
+
+    // Rebuild the index from the entries that weren't removed.
+    void sweep()
+    {
+        auto entries = std::move(m_entries);
+        auto live    = std::move(m_live);
+
+        clear();
+
+        for (size_t id = 0; id < entries.size(); ++id) {
+            if (live[id / 64] & (quint64(1) << (id % 64))) {
+                insert(std::move(entries[id]));
+            }
+        }
+    }
+
+    bool isLive(size_t id) const
+    {
+        return m_live[id / 64] & (quint64(1) << (id % 64));
+    }
+
+    // Count the entries that weren't removed in [first, last).
+    qsizetype countLive(size_t first, size_t last) const
+    {
+        qsizetype count = 0;
+
+        for (; first < last && first % 64 != 0; ++first) {
+            count += isLive(first);
+        }
+
+        for (; first + 64 <= last; first += 64) {
+            count += std::bitset<64>(m_live[first / 64]).count();
+        }
+
+        for (; first < last; ++first) {
+            count += isLive(first);
+        }
+
+        return count;
+    }
+
+    // Collect the distinct trigrams of the text.
+    static void trigrams(std::string_view text, std::vector<quint32>& out)
+    {
+        out.clear();
+
+        for (size_t i = 0; i + 3 <= text.size(); ++i) {
+            out.push_back(quint32(uchar(text[i])) << 16 | quint32(uchar(text[i + 1])) << 8 | uchar(text[i + 2]));
+        }
+
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+    }
+
+    // Find the longest string that every match of the regular expression contains. Returns an empty
+    // string when it can't be told (ex. alternatives, options like "(?i)", or escapes like "\x41").
+    static std::string requiredLiteral(std::string_view pattern)
+    {
+        for (size_t i = 0; i + 1 < pattern.size(); ++i) {
+            if (pattern[i] == '\\' && isalnum(uchar(pattern[i + 1]))) {
+                return {};
+            } else if (pattern[i] == '(' && (pattern[i + 1] == '?' || pattern[i + 1] == '*')) {
+                return {};
+            }
+
+            i += pattern[i] == '\\';
+        }
+
+        std::string longest;
+        std::string current;
+        int         depth = 0;
+
+        const auto flush = [&]() {
+            if (current.size() > longest.size()) {
+                longest = current;
+            }
+
+            current.clear();
+        };
+
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            switch (const auto c = pattern[i]) {
+            case '|':
+                if (depth == 0) {
+                    return {};
+                }
+                break;
+            case '*':
+            case '?':
+            case '{':
+                // The previous character is optional.
+                if (!current.empty()) {
+                    current.pop_back();
+                }
+
+                flush();
+
+                if (c == '{') {
+                    i = std::min(pattern.find('}', i), pattern.size());
+                }
+                break;
+            case '[':
+                flush();
+
+                // Skip the class, in which a leading ']' is literal.
+                i += 1 + (i + 1 < pattern.size() && pattern[i + 1] == '^');
+                i += i < pattern.size() && pattern[i] == ']';
+
+                for (; i < pattern.size() && pattern[i] != ']'; ++i) {
+                    i += pattern[i] == '\\';
+                }
+                break;
+            case '(':
+                flush();
+                depth++;
+                break;
+            case ')':
+                flush();
+                depth--;
+                break;
+            case '\\':
+                if (i + 1 < pattern.size() && !isalnum(uchar(pattern[i + 1])) && depth == 0) {
+                    current += pattern[++i];
+                } else {
+                    flush();
+                    i++;
+                }
+                break;
+            case '+':
+            case '.':
+            case '^':
+            case '$':
+                flush();
+                break;
+            default:
+                if (depth == 0) {
+                    current += c;
+                }
+            }
+        }
+
+        flush();
+
+        return longest;
+    }
+
+    std::vector<Entry>                                m_entries;
+    std::vector<quint64>                              m_live;
+    std::unordered_map<quint32, std::vector<quint32>> m_postings;
+    std::unordered_map<std::string, size_t>           m_ids;
+    std::vector<quint32>                              m_trigrams;
+    size_t                                            m_first   = 0;
+    size_t                                            m_count   = 0;
+    size_t                                            m_removed = 0;
+    size_t                                            m_maxSize = 10000;
+    bool                                              m_unique  = true;
+};
+
+// HistoryStore appends the history entries to a journal as they are added, so that a crash doesn't
+// lose the session. The entries are written by a background thread which commits everything queued
+// since its last write at once. Each record is framed by its size on both ends and checksummed:
+// loading reads only the newest records of the memory-mapped journal, walking it backwards, and a
+// record torn by a crash is cut off. The journal is compacted in the background once it holds twice
+// as many entries as the history keeps.
+//
+// A shared journal may be appended to by several processes. Writes and compactions then hold a lock
+// file, and the thread picks up the records appended by other processes from where it last read,
+// polling the size of the file. The records are numbered consecutively across the processes and
+// compacting keeps their numbers, so the last record read is found again by its number after another
+// process compacts the journal, and the number of records is told by the first and the last ones.
+class QConsole::HistoryStore : public QThread
+{
+public:
+    // Open the journal and append its newest entries to the string in the format of replxx history
+    // files. Returns false if the file isn't a journal.
+    bool open(const QString& path, int maxSize, bool shared, std::string& entries)
+    {
+        m_path    = path;
+        m_maxSize = maxSize;
+        m_shared  = shared;
+
+        QLockFile lock(m_path + QStringLiteral(".lock"));
+        QFile     file(path);
+
+        // Without the lock, a shared journal is read but not modified; the thread writes the new
+        // entries once it can lock it.
+        const auto locked = !shared || lock.lock();
+
+        if (!file.open(QIODevice::ReadWrite)) {
+            return false;
+        }
+
+        if (file.size() == 0) {
+            if (!locked) {
+                return false;
+            }
+
+            m_offset = MagicSize;
+            return file.write(Magic, MagicSize) == MagicSize;
+        }
+
+        if (file.read(MagicSize) != QByteArray::fromRawData(Magic, MagicSize)) {
+            return false;
+        }
+
+        const auto size = size_t(file.size());
+        const auto data = file.map(0, file.size());
+
+        // New entries can still be appended even if the existing ones can't be read.
+        if (data == nullptr) {
+            m_offset = size;
+            return true;
+        }
+
+        std::vector<Record> records;
+        bool                complete = false;
+
+        const auto end = scan(data, size, maxSize, records, complete);
+
+        for (const auto& record : records) {
+            entries.append("### ").append(record.payload).append("\n");
+        }
+
+        setOffset(data, end);
+        m_records = countRecords(data, size, end);
+        file.unmap(data);
+
+        // Cut off what a crash left of the last write.
+        if (end < size && locked) {
+            file.resize(qint64(end));
+        }
+
+        m_compact = !complete;
+
+        return true;
+    }
+
+    // Replace the journal with the specified entries.
+    bool rewrite(const std::vector<std::string>& entries)
+    {
+        QByteArray buffer(Magic, MagicSize);
+        quint64    sequence = 0;
+
+        for (const auto& entry : entries) {
+            appendRecord(buffer, ++sequence, entry);
+        }
+
+        QLockFile lock(m_path + QStringLiteral(".lock"));
+        QSaveFile file(m_path);
+
+        if (m_shared && !lock.lock()) {
+            return false;
+        }
+
+        if (!file.open(QIODevice::WriteOnly) || file.write(buffer) != buffer.size() || !file.commit()) {
+            return false;
+        }
+
+        m_records = entries.size();
+        m_compact = false;
+
+        setOffset(reinterpret_cast<const uchar*>(buffer.constData()), size_t(buffer.size()));
+
+        return true;
+    }
+
+    // Queue an entry made of a timestamp and the text of a line separated by a line feed.
+    void append(std::string&& entry)
+    {
+        QMutexLocker locker(&m_lock);
+
+        m_pending.push_back(std::move(entry));
+        m_condition.wakeOne();
+    }
+
+    // Move the entries appended by other processes since the last call to the vector.
+    void receive(std::vector<std::string>& entries)
+    {
+        QMutexLocker locker(&m_lock);
+
+        entries.swap(m_received);
+        m_received.clear();
+    }
+
+    void setMaxSize(int size)
+    {
+        QMutexLocker locker(&m_lock);
+
+        m_maxSize = size;
+    }
+
+    // Commit the queued entries and stop the thread.
+    void stop()
+    {
+        {
+            QMutexLocker locker(&m_lock);
+
+            m_stopping = true;
+            m_condition.wakeOne();
+        }
+
+        wait();
+    }
+
+protected:
+    void run() override
+    {
+        std::vector<std::string> batch;
+        std::vector<std::string> received;
+        QByteArray               buffer;
+        bool                     retry = false;
+
+        for (;;) {
+            bool stopping = false;
+            bool compact  = false;
+            int  maxSize  = 0;
+
+            {
+                QMutexLocker locker(&m_lock);
+
+                // After failing to lock the journal, wait for the next poll before trying again.
+                if (retry && !m_stopping) {
+                    m_condition.wait(&m_lock, QDeadlineTimer(1000));
+                }
+
+                while (m_pending.empty() && !m_stopping && !m_compact) {
+                    // Poll the journal for the records of other processes.
+                    const auto timeout = m_shared ? QDeadlineTimer(1000) : QDeadlineTimer(QDeadlineTimer::Forever);
+
+                    if (!m_condition.wait(&m_lock, timeout) && isModified()) {
+                        break;
+                    }
+                }
+
+                batch.swap(m_pending);
+                stopping  = m_stopping;
+                maxSize   = m_maxSize;
+                compact   = m_compact || m_records + batch.size() > 2 * size_t(maxSize);
+                m_compact = false;
+            }
+
+            // A shared journal is only modified with the lock. Without it, the entries are kept
+            // for the next try; those still pending when stopping are lost.
+            QLockFile  lock(m_path + QStringLiteral(".lock"));
+            const auto locked = m_shared && lock.lock();
+
+            retry = m_shared && !locked;
+
+            if (retry) {
+                if (stopping) {
+                    break;
+                }
+
+                QMutexLocker locker(&m_lock);
+
+                m_pending.insert(m_pending.begin(), std::make_move_iterator(batch.begin()),
+                                 std::make_move_iterator(batch.end()));
+                m_compact = m_compact || compact;
+                batch.clear();
+                continue;
+            }
+
+            if (locked) {
+                readRecords(received);
+            }
+
+            if (!batch.empty()) {
+                buffer.clear();
+
+                auto sequence = m_sequence;
+
+                for (const auto& entry : batch) {
+                    appendRecord(buffer, ++sequence, entry);
+                }
+
+                if (write(buffer)) {
+                    m_records += batch.size();
+                }
+
+                batch.clear();
+            }
+
+            if (compact && !stopping) {
+                compactJournal(maxSize);
+            }
+
+            if (!received.empty()) {
+                QMutexLocker locker(&m_lock);
+
+                std::move(received.begin(), received.end(), std::back_inserter(m_received));
+                received.clear();
+            }
+
+            if (stopping) {
+                break;
+            }
+        }
+    }
+
+private:
+    static constexpr const char* Magic     = "QCHIST2\n";
+    static constexpr qint64      MagicSize = 8;
+
+    // The size of the framing of a record: its size, checksum, and sequence number before it and its
+    // size after it. The checksum covers the sequence number and the payload.
+    static constexpr size_t FrameSize     = 20;
+    static constexpr size_t PayloadOffset = 16;
+
+    struct Record
+    {
+        quint64          sequence;
+        std::string_view payload;
+    };
+
+    static quint32 checksum(const uchar* data, size_t size)
+    {
+        quint32 hash = 2166136261u;
+
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ data[i]) * 16777619u;
+        }
+
+        return hash;
+    }
+
+    static void appendRecord(QByteArray& buffer, quint64 sequence, std::string_view payload)
+    {
+        const auto start  = buffer.size();
+        const auto size   = qToLittleEndian(quint32(payload.size()));
+        const auto number = qToLittleEndian(sequence);
+
+        buffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        buffer.append(4, '\0');
+        buffer.append(reinterpret_cast<const char*>(&number), sizeof(number));
+        buffer.append(payload.data(), qsizetype(payload.size()));
+        buffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+
+        const auto data = reinterpret_cast<const uchar*>(buffer.constData()) + start;
+        const auto hash = qToLittleEndian(checksum(data + 8, payload.size() + 8));
+
+        memcpy(buffer.data() + start + 4, &hash, sizeof(hash));
+    }
+
+    static quint64 sequenceAt(const uchar* data, size_t start)
+    {
+        return qFromLittleEndian<quint64>(data + start + 8);
+    }
+
+    // Check the record starting at "start" and set "end" past it.
+    static bool recordAt(const uchar* data, size_t size, size_t start, size_t& end)
+    {
+        if (size - start < FrameSize) {
+            return false;
+        }
+
+        const auto length = qFromLittleEndian<quint32>(data + start);
+
+        if (length > size - start - FrameSize) {
+            return false;
+        }
+
+        end = start + FrameSize + length;
+
+        return qFromLittleEndian<quint32>(data + end - 4) == length
+               && qFromLittleEndian<quint32>(data + start + 4) == checksum(data + start + 8, length + 8);
+    }
+
+    // Check the record ending at "end" and set "start" to its beginning.
+    static bool recordBefore(const uchar* data, size_t end, size_t& start)
+    {
+        if (end - MagicSize < FrameSize) {
+            return false;
+        }
+
+        const auto length = qFromLittleEndian<quint32>(data + end - 4);
+
+        if (length > end - MagicSize - FrameSize) {
+            return false;
+        }
+
+        size_t recordEnd = 0;
+        start            = end - FrameSize - length;
+
+        return recordAt(data, end, start, recordEnd);
+    }
+
+    // Collect the newest "count" records of the journal, oldest first, and return the end of the
+    // valid records. "complete" is set if all the records were collected.
+    static size_t scan(const uchar* data, size_t size, int count, std::vector<Record>& records, bool& complete)
+    {
+        size_t end   = size;
+        size_t start = 0;
+
+        // If the last record is torn, find where the valid records end from the beginning.
+        if (end > MagicSize && !recordBefore(data, end, start)) {
+            end = MagicSize;
+
+            for (size_t next = 0; recordAt(data, size, end, next);) {
+                end = next;
+            }
+        }
+
+        auto position = end;
+
+        while (records.size() < size_t(std::max(count, 0)) && position > MagicSize
+               && recordBefore(data, position, start)) {
+            records.push_back({ sequenceAt(data, start),
+                                std::string_view(reinterpret_cast<const char*>(data + start + PayloadOffset),
+                                                 position - start - FrameSize) });
+            position = start;
+        }
+
+        std::reverse(records.begin(), records.end());
+        complete = position == MagicSize;
+
+        return end;
+    }
+
+    static void sync(QFile& file)
+    {
+#ifdef Q_OS_WIN32
+        _commit(file.handle());
+#else
+        fsync(file.handle());
+#endif
+    }
+
+    // Remember the end of the records read so far and the sequence number of the last one.
+    void setOffset(const uchar* data, size_t end)
+    {
+        size_t start = 0;
+
+        m_offset   = end;
+        m_sequence = end > size_t(MagicSize) && recordBefore(data, end, start) ? sequenceAt(data, start) : 0;
+    }
+
+    // Return the number of records before "end", told by the sequence numbers of the first and the
+    // last ones since they're consecutive.
+    static size_t countRecords(const uchar* data, size_t size, size_t end)
+    {
+        size_t start = 0;
+        size_t next  = 0;
+
+        if (end <= size_t(MagicSize) || !recordBefore(data, end, start) || !recordAt(data, size, MagicSize, next)) {
+            return 0;
+        }
+
+        return size_t(sequenceAt(data, start) - sequenceAt(data, MagicSize) + 1);
+    }
+
+    bool isModified() const
+    {
+        return m_shared && size_t(QFileInfo(m_path).size()) != m_offset;
+    }
+
+    bool write(const QByteArray& buffer)
+    {
+        QFile file(m_path);
+
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Append) || file.write(buffer) != buffer.size()) {
+            return false;
+        }
+
+        file.flush();
+        sync(file);
+
+        // The records read by the next call to "readRecords" start past the new ones.
+        const auto data   = reinterpret_cast<const uchar*>(buffer.constData()) + buffer.size();
+        const auto length = qFromLittleEndian<quint32>(data - 4);
+
+        m_offset   = size_t(file.size());
+        m_sequence = qFromLittleEndian<quint64>(data - FrameSize - length + 8);
+
+        return true;
+    }
+
+    // Read the records appended by other processes since the last read.
+    void readRecords(std::vector<std::string>& entries)
+    {
+        QFile file(m_path);
+
+        if (!file.open(QIODevice::ReadWrite) || size_t(file.size()) == m_offset) {
+            return;
+        }
+
+        const auto size = size_t(file.size());
+        const auto data = file.map(0, file.size());
+
+        if (data == nullptr || size < MagicSize) {
+            return;
+        }
+
+        auto   position = m_offset;
+        size_t start    = 0;
+
+        // Another process compacted the journal: skip the records up to the last one read, which may
+        // have been compacted away.
+        if (size < m_offset || !recordBefore(data, m_offset, start) || sequenceAt(data, start) != m_sequence) {
+            std::vector<Record> records;
+            bool                complete = false;
+
+            position = MagicSize;
+
+            for (auto end = scan(data, size, 0, records, complete); end > MagicSize;) {
+                if (!recordBefore(data, end, start)) {
+                    break;
+                }
+
+                if (sequenceAt(data, start) <= m_sequence) {
+                    position = end;
+                    break;
+                }
+
+                end = start;
+            }
+        }
+
+        for (size_t next = 0; recordAt(data, size, position, next); position = next) {
+            entries.emplace_back(reinterpret_cast<const char*>(data + position + PayloadOffset),
+                                 next - position - FrameSize);
+        }
+
+        setOffset(data, position);
+        m_records = countRecords(data, size, position);
+        file.unmap(data);
+
+        // Cut off what a crashed process left of its last write, so that it isn't followed by new
+        // records.
+        if (position < size) {
+            file.resize(qint64(position));
+        }
+    }
+
+    // Rewrite the journal with its newest records only.
+    void compactJournal(int maxSize)
+    {
+        QFile file(m_path);
+
+        if (!file.open(QIODevice::ReadOnly)) {
+            return;
+        }
+
+        const auto size = size_t(file.size());
+        const auto data = file.map(0, file.size());
+
+        if (data == nullptr || size < MagicSize) {
+            return;
+        }
+
+        std::vector<Record> records;
+        bool                complete = false;
+
+        scan(data, size, maxSize, records, complete);
+
+        // The records keep their sequence numbers so that the other processes find their place.
+        QByteArray buffer(Magic, MagicSize);
+
+        for (const auto& record : records) {
+            appendRecord(buffer, record.sequence, record.payload);
+        }
+
+        file.unmap(data);
+        file.close();
+
+        QSaveFile out(m_path);
+
+        if (out.open(QIODevice::WriteOnly) && out.write(buffer) == buffer.size() && out.commit()) {
+            m_records = records.size();
+            setOffset(reinterpret_cast<const uchar*>(buffer.constData()), size_t(buffer.size()));
+        }
+    }
+
+    QString                  m_path;
+    QMutex                   m_lock;
+    QWaitCondition           m_condition;
+    std::vector<std::string> m_pending;
+    std::vector<std::string> m_received;
+    int                      m_maxSize      = 0;
+    size_t                   m_records      = 0;
+    size_t                   m_offset       = 0;
+    quint64                  m_sequence     = 0;
+    bool                     m_shared       = false;
+    bool                     m_compact      = false;
+    bool                     m_stopping     = false;
+};
+
+// Session is a client attached to the console through the server. It has its own prompt and output
+// stream, and buffers what the client sent until a line is complete. The output is sent to the
+// client once the line is evaluated.
+struct QConsole::Session
+{
+    explicit Session(QIODevice* device, const std::string& prompt)
+      : socket(device)
+      , stream(&output)
+      , prompt(prompt)
+    {
+    }
+
+    QPointer<QIODevice> socket;
+    QString             output;
+    QTextStream         stream;
+    QByteArray          buffer;
+    std::string         prompt;
+    bool                evaluating    = false;
+    bool                closing       = false;
+    bool                authenticated = true;
+};
+
+// Server accepts sessions on a local socket or on a TCP port bound to localhost. The sessions are
+// served by the event loop of the console thread, without a thread per client: the lines they send
+// are evaluated by the shared commands as they are completed, and the output of each line is sent
+// back to the session that evaluated it.
+class QConsole::Server
+{
+public:
+    // The longest line a client may send before its session is closed, and the most input buffered
+    // while the session waits for a line to be evaluated.
+    static constexpr qsizetype MaxLineLength = 64 * 1024;
+    static constexpr qsizetype MaxInputSize  = 16 * MaxLineLength;
+
+    explicit Server(QConsole* console)
+      : m_console(console)
+    {
+    }
+
+    ~Server()
+    {
+        close();
+    }
+
+    bool listen(const QString& name)
+    {
+        close();
+
+        // Remove the socket left behind by a process that crashed, but not the one of a process
+        // still accepting sessions.
+        QLocalSocket probe;
+        probe.connectToServer(name);
+
+        if (probe.waitForConnected(1000)) {
+            return false;
+        }
+
+        if (probe.error() == QLocalSocket::ConnectionRefusedError) {
+            QLocalServer::removeServer(name);
+        }
+
+        auto server = new QLocalServer();
+        server->setSocketOptions(QLocalServer::UserAccessOption);
+
+        if (!server->listen(name)) {
+            delete server;
+            return false;
+        }
+
+        QObject::connect(server, &QLocalServer::newConnection, m_console, [this, server]() {
+            while (const auto socket = server->nextPendingConnection()) {
+                accept(socket);
+            }
+        });
+
+        m_server = server;
+        return true;
+    }
+
+    bool listen(quint16 port, const QString& token)
+    {
+        close();
+
+        auto server = new QTcpServer();
+
+        if (!server->listen(QHostAddress::LocalHost, port)) {
+            delete server;
+            return false;
+        }
+
+        m_token = token.toUtf8();
+
+        QObject::connect(server, &QTcpServer::newConnection, m_console, [this, server]() {
+            while (const auto socket = server->nextPendingConnection()) {
+                accept(socket);
+            }
+        });
+
+        m_server = server;
+        return true;
+    }
+
+    // Stop accepting sessions and close the open ones.
+    void close()
+    {
+        bool evaluating = false;
+
+        for (const auto& session : std::exchange(m_sessions, {})) {
+            evaluating       = evaluating || session->evaluating;
+            session->closing = true;
+
+            if (session->socket) {
+                send(*session);
+                session->socket->close();
+            }
+        }
+
+        // The sockets are children of the server, so it's deleted later when the server is closed by
+        // a command evaluated by one of its sessions.
+        if (evaluating) {
+            m_server->deleteLater();
+        } else {
+            delete m_server;
+        }
+
+        m_server = nullptr;
+        m_token.clear();
+    }
+
+    // Return the session so that the jobs it started can keep it alive, or null if it's closed.
+    std::shared_ptr<Session> find(const Session* session) const
+    {
+        for (const auto& s : m_sessions) {
+            if (s.get() == session) {
+                return s;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Evaluate the complete lines the session sent, and close it if it's closing. Commands running a
+    // nested event loop may receive more data from the client, and a line may wait for asynchronous
+    // commands, so the lines are only evaluated while the session isn't already evaluating one.
+    void process(const std::shared_ptr<Session>& session)
+    {
+        if (session->evaluating) {
+            return;
+        }
+
+        session->evaluating = true;
+
+        qsizetype begin     = 0;
+        qsizetype end       = 0;
+        bool      suspended = false;
+
+        while (!session->closing && (end = session->buffer.indexOf('\n', begin)) >= 0) {
+            auto line = session->buffer.mid(begin, end - begin);
+            begin     = end + 1;
+
+            if (line.endsWith('\r')) {
+                line.chop(1);
+            }
+
+            // Close the session on EOF (ctrl+d) like the terminal does.
+            if (line.startsWith('\x04')) {
+                session->closing = true;
+                break;
+            }
+
+            if (!session->authenticated) {
+                if (!authenticate(*session, line)) {
+                    break;
+                }
+
+                continue;
+            }
+
+            if (!evaluate(session, line)) {
+                suspended = true;
+                break;
+            }
+        }
+
+        session->buffer.remove(0, begin);
+
+        // The session goes on once the line is evaluated.
+        if (suspended) {
+            return;
+        }
+
+        session->evaluating = false;
+
+        if (!session->closing && session->buffer.startsWith('\x04')) {
+            session->closing = true;
+        }
+
+        if (session->closing) {
+            if (const auto i = m_sessions.find(session->socket.data()); i != m_sessions.end() && *i == session) {
+                m_sessions.erase(i);
+            }
+
+            if (const auto device = session->socket; device != nullptr) {
+                send(*session);
+                device->close();
+                device->deleteLater();
+            }
+        }
+    }
+
+private:
+    template<typename T>
+    void accept(T* socket)
+    {
+        const auto session = std::make_shared<Session>(socket, m_console->m_defaultPrompt);
+        m_sessions.insert(socket, session);
+
+        session->authenticated = m_token.isEmpty();
+
+        QObject::connect(socket, &T::readyRead, m_console, [this, socket]() { read(socket); });
+        QObject::connect(socket, &T::disconnected, m_console, [this, socket]() {
+            // The socket of a session evaluating a line is deleted once the line is evaluated.
+            if (const auto session = m_sessions.take(socket); session && session->evaluating) {
+                session->closing = true;
+            } else {
+                socket->deleteLater();
+            }
+        });
+
+        // The prompt is written once the client sent the token.
+        if (session->authenticated) {
+            writePrompt(*session);
+        }
+    }
+
+    void read(QIODevice* socket)
+    {
+        // Keep the session alive in case it's closed by the command it's evaluating.
+        const auto session = m_sessions.value(socket);
+
+        if (!session) {
+            return;
+        }
+
+        // The input of a closing session is dropped.
+        if (session->closing) {
+            socket->readAll();
+            return;
+        }
+
+        session->buffer.append(socket->readAll());
+
+        // The input is bounded as it arrives: a line without an end, or lines sent faster than they
+        // are evaluated, close the session instead of growing the buffer.
+        const auto incomplete = session->buffer.size() - session->buffer.lastIndexOf('\n') - 1;
+
+        if (incomplete > MaxLineLength || session->buffer.size() > MaxInputSize) {
+            const auto message = incomplete > MaxLineLength ? QStringLiteral("Line too long")
+                                                            : QStringLiteral("Too much input");
+
+            session->stream << QConsole::colorize(message, QConsole::Color::Red, QConsole::Style::Normal) << Qt::endl;
+            session->buffer.clear();
+            session->closing = true;
+        }
+
+        process(session);
+    }
+
+    // Check the first line of the session against the token, and write the prompt if they match.
+    // Returns false and closes the session otherwise.
+    bool authenticate(Session& session, const QByteArray& line)
+    {
+        // Compare every byte so that the time taken doesn't tell how much of the token matched.
+        auto difference = line.size() ^ m_token.size();
+
+        for (qsizetype i = 0; i < line.size(); ++i) {
+            difference |= line[i] ^ m_token[i % m_token.size()];
+        }
+
+        if (difference != 0) {
+            session.stream << QConsole::colorize(QStringLiteral("Authentication failed"), QConsole::Color::Red,
+                                                 QConsole::Style::Normal)
+                           << Qt::endl;
+            session.closing = true;
+            return false;
+        }
+
+        session.authenticated = true;
+        writePrompt(session);
+        return true;
+    }
+
+    // Evaluate the line and write the prompt. Returns false if the line waits for asynchronous
+    // commands, in which case the prompt is written and the next lines are evaluated once it's done.
+    bool evaluate(const std::shared_ptr<Session>& session, const QByteArray& line)
+    {
+        const auto previous  = m_console->m_session;
+        m_console->m_session = session.get();
+
+        const auto suspension =
+          m_console->evaluateLine(std::string_view(line.constData(), size_t(line.size())), false, &session->stream);
+        m_console->m_session = previous;
+
+        if (suspension) {
+            suspension->session = session;
+            suspension->resume  = [this, session]() {
+                if (!session->closing) {
+                    writePrompt(*session);
+                }
+
+                session->evaluating = false;
+                process(session);
+            };
+
+            return false;
+        }
+
+        if (!session->closing) {
+            writePrompt(*session);
+        }
+
+        return true;
+    }
+
+    void writePrompt(Session& session)
+    {
+        session.stream << QString::fromStdString(session.prompt);
+        send(session);
+    }
+
+    void send(Session& session)
+    {
+        session.stream.flush();
+
+        if (session.socket && session.socket->isOpen() && !session.output.isEmpty()) {
+            session.socket->write(session.output.toUtf8());
+        }
+
+        session.output.clear();
+    }
+
+    QConsole*                                   m_console;
+    QObject*                                    m_server = nullptr;
+    QByteArray                                  m_token;
+    QHash<QIODevice*, std::shared_ptr<Session>> m_sessions;
+};
+
+QConsole::QConsole(QObject* parent)
+  : QConsole(std::make_shared<Registry>(), parent)
+{
+}
+
+QConsole::QConsole(const std::shared_ptr<Registry>& registry, QObject* parent)
+  : QObject(parent)
+  , m_registry(registry != nullptr ? registry : std::make_shared<Registry>())
+  , m_terminal(new Terminal())
+  , m_reader(nullptr)
+  , m_output(new OutputQueue())
+  , m_completionCache(new CompletionCache())
+  , m_highlighter(new Highlighter())
+  , m_history(nullptr)
+  , m_historyIndex(new HistoryIndex())
+  , m_server(nullptr)
+  , m_session(nullptr)
+  , m_depth(0)
+  , m_completionPool(new QThreadPool(this))
+  , m_argumentCompletionTimeout(100)
+  , m_jobPool(new QThreadPool(this))
+  , m_lastJobID(0)
+  , m_pagerPool(new QThreadPool(this))
+  , m_asyncCommands(0)
+  , m_quitWhenIdle(false)
+  , m_suspensions(0)
+  , m_maxHistorySize(10000)
+  , m_echo(true)
+  , m_paging(true)
+  , m_sharedHistory(false)
+  , m_fuzzyCompletion(false)
+  , m_fuzzyCompletionCount(64)
+  , m_timerID(0)
+  , m_running(false)
+  , m_terminalOutput(true)
+  , m_inputMode(InputMode::Blocking)
+  , m_reading(false)
+  , m_ostream(stdout)
+{
+    m_terminal->set_max_hint_rows(0);
+    m_terminal->bind_key_internal(Replxx::KEY::control('N'), "history_next");
+    m_terminal->bind_key_internal(Replxx::KEY::control('P'), "history_previous");
+    m_terminal->set_max_history_size(m_maxHistorySize);
+    m_terminal->set_word_break_characters(" \t,%!;:=*~^'\"/?<>|&[](){}");
+    m_terminal->set_completion_count_cutoff(256);
+    m_terminal->set_double_tab_completion(false);
+    m_terminal->set_complete_on_empty(true);
+    m_terminal->set_beep_on_ambiguous_completion(true);
+    m_terminal->set_no_color(false);
+    m_terminal->set_unique_history(true);
+
+    m_completionPool->setMaxThreadCount(2);
+    m_jobPool->setMaxThreadCount(std::max(QThread::idealThreadCount(), 2));
+    m_pagerPool->setMaxThreadCount(1);
+    m_pagerPool->setExpiryTimeout(-1);
+
+    m_terminal->set_hint_callback([this](std::string const& input, int& input_length, Replxx::Color& color) {
+        if (std::string hint; findHint(input, hint, input_length)) {
+            color = Replxx::Color::BROWN;
+            return Replxx::hints_t({ std::move(hint) });
+        }
+
+        return Replxx::hints_t();
+    });
+
+    m_terminal->set_completion_callback([this](const std::string& input, int& input_length) {
+        Replxx::completions_t completions;
+        std::string_view      prefix;
+
+        for (auto& name : findCompletions(input, prefix, true, true)) {
+            completions.emplace_back(Replxx::Completion(std::move(name), Replxx::Color::BROWN));
+        }
+
+        input_length = codePointCount(prefix);
+        return completions;
+    });
+
+    m_terminal->set_highlighter_callback([this](const std::string& input, Replxx::colors_t& colors) {
+        m_highlighter->colorize(*this, input, colors);
+    });
+}
+
+void QConsole::start()
+{
+    if (!m_running) {
+        m_running = true;
+
+#ifdef Q_OS_WIN32
+        const bool interactive = _isatty(_fileno(stdin));
+#else
+        const bool interactive = isatty(STDIN_FILENO);
+#endif
+
+        if (m_inputMode == InputMode::Batch || !interactive) {
+            QMetaObject::invokeMethod(
+              this,
+              [this]() {
+                  // The input is kept open while the lines wait for asynchronous commands.
+                  const auto input = new QFile(this);
+                  input->open(stdin, QIODevice::ReadOnly);
+                  runScript(input);
+                  quitWhenIdle();
+              },
+              Qt::QueuedConnection);
+            return;
+        }
+
+        m_terminal->install_window_change_handler();
+
+        if (m_inputMode == InputMode::Asynchronous) {
+            m_reader = new Reader(this);
+            m_reader->start();
+            m_reader->requestLine(m_prompt);
+        } else {
+            m_timerID = startTimer(0, Qt::TimerType::CoarseTimer);
+        }
+    }
+}
+
+// Quit once the asynchronous commands, the lines waiting for them, and the background jobs are
+// finished, so that the output of a script ending with one of them isn't lost.
+void QConsole::quitWhenIdle()
+{
+    m_quitWhenIdle = true;
+
+    // Called again as the commands finish and the lines are evaluated.
+    if (m_asyncCommands > 0 || m_suspensions > 0) {
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_jobsLock);
+
+        for (const auto& job : m_jobs) {
+            if (!job->future.isFinished()) {
+                auto watcher = new QFutureWatcher<void>(this);
+
+                connect(watcher, &QFutureWatcher<void>::finished, this, [this, watcher]() {
+                    watcher->deleteLater();
+                    quitWhenIdle();
+                });
+
+                watcher->setFuture(job->future);
+                return;
+            }
+        }
+    }
+
+    drainOutput();
+    QCoreApplication::quit();
+}
+
+void QConsole::stop()
+{
+    if (m_running) {
+        if (m_reader != nullptr) {
+            m_reader->interrupt();
+            m_reader->wait();
+            delete m_reader;
+            m_reader = nullptr;
+        } else if (m_timerID != 0) {
+            killTimer(m_timerID);
+        }
+
+        m_timerID = 0;
+        m_running = false;
+    }
+}
+
+bool QConsole::running()
+{
+    return m_running;
+}
+
+void QConsole::setInputMode(InputMode mode)
+{
+    m_inputMode = mode;
+}
+
+QConsole::InputMode QConsole::inputMode()
+{
+    return m_inputMode;
+}
+
+QConsole::~QConsole()
+{
+    // The jobs stop before their next command, and as soon as their current command checks its output.
+    {
+        QMutexLocker locker(&m_jobsLock);
+
+        for (const auto& job : m_jobs) {
+            job->killed = true;
+        }
+    }
+
+    m_jobPool->waitForDone();
+
+    delete m_server;
+
+    if (m_running) {
+        stop();
+        m_terminal->invoke(Replxx::ACTION::CLEAR_SELF, 0);
+    }
+
+    drainOutput();
+
+    // The journal already holds every entry once the pending ones are committed.
+    if (m_history != nullptr) {
+        m_history->stop();
+        delete m_history;
+    } else if (!m_historyFilePath.empty()) {
+        m_terminal->history_save(m_historyFilePath);
+    }
+
+    if (!m_echo) {
+        setStdinEcho(true);
+    }
+
+    {
+        QMutexLocker locker(&m_completionLock);
+
+        if (m_pendingCompletion) {
+            m_pendingCompletion->request.cancel();
+        }
+    }
+
+    m_completionPool->waitForDone();
+
+    qDeleteAll(m_tokenizers);
+
+    delete m_output;
+    delete m_completionCache;
+    delete m_highlighter;
+    delete m_historyIndex;
+    delete m_terminal;
+}
+
+std::shared_ptr<QConsole::Registry> QConsole::registry()
+{
+    return m_registry;
+}
+
+bool QConsole::listen(const QString& name)
+{
+    if (m_server == nullptr) {
+        m_server = new Server(this);
+    }
+
+    return m_server->listen(name);
+}
+
+bool QConsole::listen(quint16 port, const QString& token)
+{
+    if (m_server == nullptr) {
+        m_server = new Server(this);
+    }
+
+    return m_server->listen(port, token);
+}
+
+void QConsole::stopListening()
+{
+    if (m_server != nullptr) {
+        m_server->close();
+    }
+}
+
+void QConsole::setOutputDevice(QIODevice* device)
+{
+    drainOutput();
+
+    m_ostream.device()->close();
+    m_ostream.setDevice(device);
+    m_terminalOutput = false;
+}
+
+bool QConsole::invokeCommandByName(const QString& name, const Context& ctx)
+{
+    refreezeCommands();
+
+    // The snapshot keeps the command alive while it runs, even if it removes itself.
+    const auto snapshot = m_registry->snapshot();
+
+    if (const auto c = findCommandByName(*snapshot, name.toUtf8().toStdString()); c != nullptr) {
+        // Only the lines wait for the futures the command awaits (ex. "wait").
+        const auto awaited = m_awaited.size();
+
+        invokeCommand(*c, ctx);
+        m_awaited.resize(awaited);
+        return true;
+    }
+
+    return false;
+}
+
+std::optional<QFuture<void>> QConsole::invokeCommand(const Node& node, const Context& ctx)
+{
+    const auto& command = node.command;
+
+#ifdef QCONSOLE_STATISTICS
+    // The statistics are kept alive in case the command removes itself.
+    const auto    statistics = node.statistics;
+    QElapsedTimer timer;
+    timer.start();
+#endif
+
+    if (command.threadPool == nullptr && !command.invokeAsync) {
+#ifdef QCONSOLE_STATISTICS
+        // Exceptions are counted as errors on their way out.
+        const auto guard = qScopeGuard([&statistics, &timer, exceptions = std::uncaught_exceptions()]() {
+            statistics->record(timer, std::uncaught_exceptions() > exceptions);
+        });
+#endif
+
+        if (ctx.output == nullptr || ctx.console == nullptr) {
+            command.invoke(Context{ ctx.arguments, ctx.output != nullptr ? ctx.output : &m_ostream,
+                                    ctx.console != nullptr ? ctx.console : this });
+        } else {
+            command.invoke(ctx);
+        }
+
+        return std::nullopt;
+    }
+
+    const auto invocation = std::make_shared<Invocation>(ctx.arguments, ctx.console != nullptr ? ctx.console : this);
+
+    QFuture<void> future;
+
+    if (command.invokeAsync) {
+        future = command.invokeAsync(invocation->context);
+    } else {
+        const auto promise = std::make_shared<QPromise<void>>();
+        future             = promise->future();
+
+        promise->start();
+
+        command.threadPool->start([invocation, promise, callback = command.invoke]() {
+            try {
+                callback(invocation->context);
+            } catch (...) {
+                promise->setException(std::current_exception());
+            }
+
+            promise->finish();
+        });
+    }
+
+    auto watcher = new QFutureWatcher<void>(this);
+    m_asyncCommands++;
+
+    // The output of the commands invoked by a session is sent to the session, if it's still open.
+    std::optional<QPointer<QIODevice>> remote;
+
+    if (m_session != nullptr) {
+        remote = m_session->socket;
+    }
+
+    connect(watcher, &QFutureWatcher<void>::finished, this, [this, watcher, invocation, remote, name = command.name]() {
+        invocation->stream.flush();
+
+        try {
+            watcher->waitForFinished();
+        } catch (const std::exception& e) {
+            invocation->output.append(
+              QConsole::colorize(QStringLiteral("Command failed: %1: %2\n").arg(name, QString::fromUtf8(e.what())),
+                                 QConsole::Color::Red, QConsole::Style::Normal));
+        } catch (...) {
+            invocation->output.append(QConsole::colorize(QStringLiteral("Command failed: %1\n").arg(name),
+                                                         QConsole::Color::Red, QConsole::Style::Normal));
+        }
+
+        if (watcher->isCanceled()) {
+            invocation->output.append(QConsole::colorize(QStringLiteral("Command canceled: %1\n").arg(name),
+                                                         QConsole::Color::Red, QConsole::Style::Normal));
+        }
+
+        if (!remote) {
+            print(invocation->output);
+        } else if (const auto device = *remote; device != nullptr && device->isOpen()) {
+            device->write(invocation->output.toUtf8());
+        }
+
+        watcher->deleteLater();
+
+        if (--m_asyncCommands == 0 && m_quitWhenIdle) {
+            quitWhenIdle();
+        }
+    });
+
+#ifdef QCONSOLE_STATISTICS
+    connect(watcher, &QFutureWatcher<void>::finished, this, [watcher, statistics, timer]() {
+        bool failed = watcher->isCanceled();
+
+        try {
+            watcher->waitForFinished();
+        } catch (...) {
+            failed = true;
+        }
+
+        statistics->record(timer, failed);
+    });
+#endif
+
+    watcher->setFuture(future);
+
+    return future;
+}
+
+void QConsole::print(const QString& text)
+{
+    if (text.isEmpty()) {
+        return;
+    }
+
+    if (!m_output->push(QString(text))) {
+        return;
+    }
+
+    // The console thread doesn't drain the queue while it's blocked reading a line, so the text is
+    // handed to the line editor right away, which prints it above the prompt.
+    if (m_reading.load()) {
+        QMutexLocker locker(&m_drainLock);
+
+        if (m_reading.load()) {
+            if (const auto batch = m_output->drain(); !batch.isEmpty()) {
+                m_terminal->print("%s", batch.toUtf8().constData());
+            }
+
+            return;
+        }
+    }
+
+    QMetaObject::invokeMethod(
+      this, [this]() { drainOutput(); }, Qt::QueuedConnection);
+}
+
+void QConsole::drainOutput()
+{
+    QMutexLocker locker(&m_drainLock);
+
+    const auto batch = m_output->drain();
+
+    if (batch.isEmpty()) {
+        return;
+    }
+
+    m_ostream.flush();
+
+    // Let replxx print through the terminal so that the prompt is redrawn below the output if the
+    // user is currently typing.
+    if (m_terminalOutput) {
+        m_terminal->print("%s", batch.toUtf8().constData());
+    } else {
+        m_ostream << batch;
+        m_ostream.flush();
+    }
+}
+
+qint64 QConsole::runScript(QIODevice* device)
+{
+    return runScript(device, QByteArray());
+}
+
+// Evaluate the input left over from a previous call, then the lines read from the device if any. A
+// line waiting for asynchronous commands suspends the script: what's left of the input is evaluated
+// once the line is, by calling this again. Returns the number of lines evaluated until then.
+qint64 QConsole::runScript(const QPointer<QIODevice>& device, QByteArray input)
+{
+    qint64 count = 0;
+
+    // Evaluate the lines and return the beginning of the incomplete line at the end, if any, unless
+    // "more" is false and it's evaluated too. Returns null if the script was suspended.
+    const auto evaluateLines = [this, &count, &device](const char* begin, const char* end,
+                                                       bool more) -> const char* {
+        while (begin != end) {
+            const auto newline = static_cast<const char*>(memchr(begin, '\n', end - begin));
+
+            if (newline == nullptr && more) {
+                break;
+            }
+
+            const auto next = newline != nullptr ? newline + 1 : end;
+            auto       last = newline != nullptr ? newline : end;
+
+            if (last > begin && last[-1] == '\r') {
+                last--;
+            }
+
+            const auto suspension = evaluateLine(std::string_view(begin, last - begin), false);
+            count++;
+
+            if (suspension != nullptr) {
+                suspension->resume = [this, device = more ? device : QPointer<QIODevice>(),
+                                      rest = QByteArray(next, end - next)]() { runScript(device, rest); };
+
+                return nullptr;
+            }
+
+            begin = next;
+        }
+
+        return begin;
+    };
+
+    // Map regular files in one piece...
+    if (auto file = qobject_cast<QFileDevice*>(device); file != nullptr && !file->isSequential() && input.isEmpty()) {
+        const auto offset = file->pos();
+        const auto size   = file->size() - offset;
+
+        if (size <= 0) {
+            return 0;
+        }
+
+        if (auto map = file->map(offset, size); map != nullptr) {
+            const auto begin = reinterpret_cast<const char*>(map);
+
+            evaluateLines(begin, begin + size, false);
+            file->unmap(map);
+            return count;
+        }
+    }
+
+    // ...and read everything else in large blocks. An incomplete line at the end of a block is
+    // moved to the front of the buffer before reading the next block.
+    QByteArray buffer = std::move(input);
+    qint64     used   = buffer.size();
+
+    buffer.resize(std::max(used * 2, qint64(1 << 16)));
+
+    // The complete lines left over are evaluated before waiting for more.
+    if (used > 0) {
+        const auto begin = buffer.constData();
+        const auto rest  = evaluateLines(begin, begin + used, device != nullptr);
+
+        if (rest == nullptr) {
+            return count;
+        }
+
+        used = begin + used - rest;
+        memmove(buffer.data(), rest, used);
+    }
+
+    while (device != nullptr) {
+        if (used == buffer.size()) {
+            buffer.resize(buffer.size() * 2);
+        }
+
+        // Reading blocks on sequential files (ex. stdin), but other sequential devices (ex. sockets)
+        // must be waited for.
+        if (device->isSequential() && device->bytesAvailable() <= 0 && qobject_cast<QFileDevice*>(device) == nullptr) {
+            device->waitForReadyRead(-1);
+        }
+
+        const auto n = device->read(buffer.data() + used, buffer.size() - used);
+
+        if (n <= 0) {
+            break;
+        }
+
+        const auto begin = buffer.constData();
+        const auto end   = begin + used + n;
+        const auto rest  = evaluateLines(begin, end, true);
+
+        if (rest == nullptr) {
+            return count;
+        }
+
+        used = end - rest;
+        memmove(buffer.data(), rest, used);
+    }
+
+    evaluateLines(buffer.constData(), buffer.constData() + used, false);
+    return count;
+}
+
+// Evaluate the line. Returns the suspension holding the rest of the line if it waits for
+// asynchronous commands or jobs, so that the caller can set what to do once it's evaluated.
+std::shared_ptr<QConsole::Suspension> QConsole::evaluateLine(std::string_view line, bool addToHistory,
+                                                             QTextStream* output)
+{
+    auto& out = output != nullptr ? *output : m_ostream;
+
+    if (m_depth == m_tokenizers.size()) {
+        m_tokenizers.append(new Tokenizer());
+    }
+
+    const auto tokenizer = m_tokenizers[m_depth++];
+    const auto guard     = qScopeGuard([this]() { m_depth--; });
+
+    const auto  valid     = tokenizer->tokenize(line);
+    const auto& tokens    = tokenizer->tokens();
+    const auto& operators = tokenizer->operators();
+
+    if (valid && tokens.empty() && operators.empty()) {
+        return nullptr;
+    }
+
+    if (addToHistory) {
+        const auto first = line.find_first_not_of(" \t");
+        const auto last  = line.find_last_not_of(" \t");
+
+        appendHistory(std::string(line.substr(first, last - first + 1)));
+
+        // The arguments the providers completed may have changed (ex. files created by the line).
+        QMutexLocker locker(&m_completionLock);
+        m_argumentCompletions.clear();
+    }
+
+    if (!valid) {
+        out << QConsole::colorize(QStringLiteral("Unterminated quote"), QConsole::Color::Red, QConsole::Style::Normal)
+            << Qt::endl;
+        return nullptr;
+    }
+
+    // Every operator must follow a command, and only "&" and ";" may end the line.
+    for (size_t i = 0; i < operators.size(); ++i) {
+        const auto& op       = operators[i];
+        const auto  previous = i > 0 ? operators[i - 1].index : 0;
+        const auto  trailing = i + 1 == operators.size() && op.index == tokens.size()
+                            && (op.kind == Operator::Pipe || op.kind == Operator::And);
+
+        if (op.index == previous || trailing) {
+            const auto text = QLatin1String(Operator::text(op.kind));
+
+            out << QConsole::colorize(QStringLiteral("Syntax error near \"%1\"").arg(text), QConsole::Color::Red,
+                                      QConsole::Style::Normal)
+                << Qt::endl;
+            return nullptr;
+        }
+    }
+
+    const auto pending = runLists(tokens.data(), tokens.size(), operators.data(), operators.size(), out);
+
+    if (!pending) {
+        return nullptr;
+    }
+
+    const auto suspension =
+      std::make_shared<Suspension>(tokens.data(), tokens.size(), operators.data(), operators.size(), *pending);
+
+    suspension->futures = std::exchange(m_awaited, {});
+    suspension->output  = &out;
+    m_suspensions++;
+
+    awaitLine(suspension);
+    return suspension;
+}
+
+// Run the lists of commands of a line: those separated by ";" run one after the other and those
+// followed by "&" run in the background. If a list waits for asynchronous commands or jobs, returns
+// the index of the operator following the pipeline it stopped after.
+std::optional<size_t> QConsole::runLists(const std::string_view* tokens, size_t size, const Operator* operators,
+                                         size_t count, QTextStream& out)
+{
+    size_t begin = 0;
+    size_t first = 0;
+
+    for (size_t i = 0; i <= count; ++i) {
+        if (i < count && operators[i].kind != Operator::Sequence && operators[i].kind != Operator::Background) {
+            continue;
+        }
+
+        const auto end = i < count ? operators[i].index : size;
+
+        if (begin == end) {
+            break;
+        }
+
+        if (i < count && operators[i].kind == Operator::Background) {
+            startJob(tokens, begin, end, operators + first, i - first, out);
+        } else {
+            size_t pending = 0;
+
+            runList(tokens, begin, end, operators + first, i - first, out, end == size, nullptr, &pending);
+
+            if (!m_awaited.empty()) {
+                return first + pending;
+            }
+        }
+
+        begin = end;
+        first = i + 1;
+    }
+
+    return std::nullopt;
+}
+
+// Wait for the last future of the suspended line without blocking the console thread.
+void QConsole::awaitLine(const std::shared_ptr<Suspension>& suspension)
+{
+    auto watcher = new QFutureWatcher<void>(this);
+
+    connect(watcher, &QFutureWatcher<void>::finished, this, [this, watcher, suspension]() {
+        watcher->deleteLater();
+        resumeLine(suspension);
+    });
+
+    watcher->setFuture(suspension->futures.back());
+}
+
+// Evaluate the rest of the suspended line once its futures are finished: "a && b" only runs b if a
+// finished without being canceled or throwing an exception, and the line may be suspended again.
+void QConsole::resumeLine(const std::shared_ptr<Suspension>& suspension)
+{
+    // The output of the commands waited for is printed before the rest of the line runs.
+    drainOutput();
+
+    auto future = suspension->futures.back();
+    suspension->futures.pop_back();
+
+    try {
+        future.waitForFinished();
+        suspension->succeeded = suspension->succeeded && !future.isCanceled();
+    } catch (...) {
+        suspension->succeeded = false;
+    }
+
+    if (!suspension->futures.empty()) {
+        return awaitLine(suspension);
+    }
+
+    auto& tokens    = suspension->tokens;
+    auto& operators = suspension->operators;
+    auto  first     = size_t(0);
+
+    // The commands following a failed "&&" are skipped up to the end of the list.
+    if (!operators.empty() && operators[0].kind == Operator::And && !suspension->succeeded) {
+        while (first < operators.size() && operators[first].kind != Operator::Sequence
+               && operators[first].kind != Operator::Background) {
+            first++;
+        }
+    }
+
+    const auto session = suspension->session;
+    const auto closed  = session != nullptr && session->closing;
+
+    // The operator the line stopped before is dropped along with the tokens preceding the next one.
+    if (first < operators.size() && !closed) {
+        const auto begin = operators[first].index;
+
+        for (auto i = first + 1; i < operators.size(); ++i) {
+            operators[i].index -= begin;
+        }
+
+        const auto previous = std::exchange(m_session, session.get());
+        const auto pending  = runLists(tokens.data() + begin, tokens.size() - begin, operators.data() + first + 1,
+                                       operators.size() - first - 1, *suspension->output);
+        m_session           = previous;
+
+        if (pending) {
+            const auto next = std::make_shared<Suspension>(tokens.data() + begin, tokens.size() - begin,
+                                                           operators.data() + first + 1,
+                                                           operators.size() - first - 1, *pending);
+
+            next->futures = std::exchange(m_awaited, {});
+            next->output  = suspension->output;
+            next->session = session;
+            next->resume  = std::move(suspension->resume);
+
+            return awaitLine(next);
+        }
+    }
+
+    if (suspension->resume) {
+        suspension->resume();
+    }
+
+    if (--m_suspensions == 0 && m_quitWhenIdle) {
+        quitWhenIdle();
+    }
+}
+
+// Run the pipelines between the tokens "begin" and "end", separated by the operators: "a && b" only
+// runs b if a succeeded. The asynchronous commands are waited for unless they end the line ("last"
+// is true if the tokens do), and a job stops before its next pipeline once it's killed. Returns true
+// if every pipeline succeeded. On the console thread, the list stops after a pipeline whose futures
+// are awaited, and "pending" is set to the index of the operator following it.
+bool QConsole::runList(const std::string_view* tokens, size_t begin, size_t end, const Operator* operators,
+                       size_t count, QTextStream& out, bool last, Job* job, size_t* pending)
+{
+    std::vector<size_t> pipes;
+
+    for (size_t i = 0; i <= count; ++i) {
+        if (i < count && operators[i].kind == Operator::Pipe) {
+            pipes.push_back(operators[i].index - begin);
+            continue;
+        }
+
+        const auto next = i < count ? operators[i].index : end;
+
+        if (job != nullptr && job->killed) {
+            return false;
+        }
+
+        const auto succeeded =
+          runPipeline(Arguments(tokens + begin, qsizetype(next - begin)), pipes, out, !last || i < count, job);
+
+        if (job != nullptr) {
+            job->flush(*this);
+        } else if (!m_awaited.empty()) {
+            *pending = i;
+            return true;
+        }
+
+        if (!succeeded) {
+            return false;
+        }
+
+        pipes.clear();
+        begin = next;
+    }
+
+    return true;
+}
+
+// Run the commands of a pipeline, each starting at the token following a pipe. Returns true if the
+// commands were found and succeeded; a single asynchronous command only counts as succeeded once
+// it's finished, so its future is awaited if "wait" is true.
+bool QConsole::runPipeline(Arguments tokens, const std::vector<size_t>& pipes, QTextStream& out, bool wait, Job* job)
+{
+    // The previous pipelines of the line may have added commands (ex. "connect && login").
+    refreezeCommands();
+
+    // The snapshot keeps the commands alive while they run.
+    const auto snapshot = m_registry->snapshot();
+
+    // Descend the tree one token at a time and return the deepest command of the tokens between
+    // "begin" and "end". The remaining tokens are its arguments.
+    const auto find = [this, &snapshot, &tokens, &out](size_t begin, size_t end, Arguments& arguments) -> const Node* {
+        const Node* node    = &snapshot->root;
+        const Node* command = nullptr;
+        size_t      depth   = begin;
+
+        for (size_t i = begin; i < end && (node = findChild(*snapshot, *node, tokens[i], true)) != nullptr; ++i) {
+            if (node->invokable) {
+                command = node;
+                depth   = i + 1;
+            }
+        }
+
+        if (command == nullptr) {
+            out << QConsole::colorize(QStringLiteral("Command not found: ")
+                                        .append(QString::fromUtf8(tokens[begin].data(), tokens[begin].size())),
+                                      QConsole::Color::Red, QConsole::Style::Normal)
+                << Qt::endl;
+            return nullptr;
+        }
+
+        arguments = Arguments(tokens.begin() + depth, qsizetype(end - depth));
+        return command;
+    };
+
+    if (pipes.empty()) {
+        Arguments  arguments;
+        const auto command = find(0, size_t(tokens.size()), arguments);
+
+        if (command == nullptr) {
+            return false;
+        }
+
+        if (job != nullptr) {
+            return invokeJobCommand(*command, arguments, out, *job);
+        }
+
+        if (const auto future = invokeCommand(*command, Context{ arguments, &out, this }); future && wait) {
+            m_awaited.push_back(*future);
+        }
+
+        return true;
+    }
+
+    std::vector<std::pair<const Node*, Arguments>> stages;
+    stages.reserve(pipes.size() + 1);
+
+    for (size_t i = 0; i <= pipes.size(); ++i) {
+        Arguments  arguments;
+        const auto end     = i < pipes.size() ? pipes[i] : size_t(tokens.size());
+        const auto command = find(i > 0 ? pipes[i - 1] : 0, end, arguments);
+
+        if (command == nullptr) {
+            return false;
+        }
+
+        stages.emplace_back(command, arguments);
+    }
+
+    return invokePipeline(stages, out);
+}
+
+bool QConsole::invokePipeline(const std::vector<std::pair<const Node*, Arguments>>& stages, QTextStream& out)
+{
+    // The commands finishing after they return can't be piped. Only the last command runs on the
+    // calling thread, so the commands using the console state must be last, and can't be piped at all
+    // in the background.
+    const auto background = QThread::currentThread() != thread();
+
+    for (size_t i = 0; i < stages.size(); ++i) {
+        const auto node = stages[i].first;
+
+        if (!node->command.invoke || (node->command.consoleThread && (background || i + 1 < stages.size()))) {
+            out << QConsole::colorize(QStringLiteral("Command can't be piped: ").append(node->command.name),
+                                      QConsole::Color::Red, QConsole::Style::Normal)
+                << Qt::endl;
+            return false;
+        }
+    }
+
+    const auto count = stages.size();
+
+    std::vector<std::unique_ptr<Pipe>>        pipes;
+    std::vector<std::unique_ptr<QTextStream>> streams;
+    std::vector<std::optional<QString>>       errors(count);
+    std::vector<qint64>                       elapsed(count);
+
+    for (size_t i = 0; i + 1 < count; ++i) {
+        pipes.push_back(std::make_unique<Pipe>());
+        streams.push_back(std::make_unique<QTextStream>(pipes.back()->sink()));
+    }
+
+    // Each command closes its ends of the pipes when it's done, so that the next command reaches the
+    // end of its input and the previous one stops producing.
+    const auto run = [this, &stages, &out, &pipes, &streams, &errors, &elapsed, count](size_t i) {
+        QElapsedTimer timer;
+        timer.start();
+
+        try {
+            stages[i].first->command.invoke(Context{ stages[i].second, i + 1 < count ? streams[i].get() : &out, this,
+                                                     i > 0 ? pipes[i - 1].get() : nullptr });
+        } catch (const std::exception& e) {
+            errors[i] = QString::fromUtf8(e.what());
+        } catch (...) {
+            errors[i] = QString();
+        }
+
+        elapsed[i] = timer.nsecsElapsed();
+
+        if (i + 1 < count) {
+            streams[i]->flush();
+            pipes[i]->closeWrite();
+        }
+
+        if (i > 0) {
+            pipes[i - 1]->closeRead();
+        }
+    };
+
+    // The last command runs on the calling thread, so that the output is only written from there.
+    std::vector<QThread*> threads;
+
+    for (size_t i = 0; i + 1 < count; ++i) {
+        threads.push_back(QThread::create(run, i));
+        threads.back()->start();
+    }
+
+    run(count - 1);
+
+    for (const auto thread : threads) {
+        thread->wait();
+        delete thread;
+    }
+
+    bool succeeded = true;
+
+    for (size_t i = 0; i < count; ++i) {
+        const auto& [node, arguments] = stages[i];
+
+#ifdef QCONSOLE_STATISTICS
+        node->statistics->record(elapsed[i], errors[i].has_value());
+#endif
+
+        if (!errors[i]) {
+            continue;
+        }
+
+        auto message = QStringLiteral("Command failed: %1").arg(node->command.name);
+
+        if (!errors[i]->isEmpty()) {
+            message.append(": ").append(*errors[i]);
+        }
+
+        out << QConsole::colorize(message, QConsole::Color::Red, QConsole::Style::Normal) << Qt::endl;
+        succeeded = false;
+    }
+
+    return succeeded;
+}
+
+// Run a command of a job on the job thread. The asynchronous commands are started on the console
+// thread as they are from the prompt, the commands using the console state are invoked there, and
+// the job waits for them until it's killed. Returns true if the command succeeded.
+bool QConsole::invokeJobCommand(const Node& node, const Arguments& arguments, QTextStream& out, Job& job)
+{
+    const auto& command = node.command;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    std::optional<QString> error;
+    bool                   canceled = false;
+
+    const auto capture = [&error]() {
+        try {
+            throw;
+        } catch (const std::exception& e) {
+            error = QString::fromUtf8(e.what());
+        } catch (...) {
+            error = QString();
+        }
+    };
+
+    if (command.invoke && !command.consoleThread) {
+        // The job already runs on a worker thread, so the thread pool of the command isn't needed.
+        try {
+            command.invoke(Context{ arguments, &out, this });
+        } catch (...) {
+            capture();
+        }
+    } else {
+        struct Start
+        {
+            QMutex             lock;
+            QWaitCondition     finished;
+            QFuture<void>      future;
+            std::exception_ptr exception;
+            bool               done      = false;
+            bool               abandoned = false;
+        };
+
+        const auto start      = std::make_shared<Start>();
+        const auto invocation = std::make_shared<Invocation>(arguments, this);
+
+        // The invocation is kept alive until the command is finished, even if the job is killed.
+        QMetaObject::invokeMethod(
+          this,
+          [this, start, invocation, invoke = command.invoke, callback = command.invokeAsync,
+           session = job.session.lock(), remote = job.remote.has_value()]() {
+              QMutexLocker locker(&start->lock);
+
+              if (start->abandoned) {
+                  return;
+              }
+
+              // The command is invoked for the session that started the job, unless it's closed.
+              if (invoke) {
+                  if (!remote || (session != nullptr && !session->closing)) {
+                      const auto previous = std::exchange(m_session, session.get());
+
+                      try {
+                          invoke(invocation->context);
+                      } catch (...) {
+                          start->exception = std::current_exception();
+                      }
+
+                      m_session = previous;
+                  }
+
+                  start->done = true;
+                  start->finished.wakeAll();
+                  locker.unlock();
+
+                  // The session is closed here if the command closed it (ex. "exit").
+                  if (session != nullptr && session->closing && m_server != nullptr) {
+                      m_server->process(session);
+                  }
+
+                  return;
+              }
+
+              try {
+                  start->future = callback(invocation->context);
+              } catch (...) {
+                  start->exception = std::current_exception();
+                  start->done      = true;
+                  start->finished.wakeAll();
+                  return;
+              }
+
+              auto watcher = new QFutureWatcher<void>(this);
+
+              connect(watcher, &QFutureWatcher<void>::finished, this, [start, invocation, watcher]() {
+                  QMutexLocker locker(&start->lock);
+
+                  start->done = true;
+                  start->finished.wakeAll();
+                  watcher->deleteLater();
+              });
+
+              watcher->setFuture(start->future);
+          },
+          Qt::QueuedConnection);
+
+        QMutexLocker locker(&start->lock);
+
+        while (!start->done && !job.killed) {
+            start->finished.wait(&start->lock, 100);
+        }
+
+        if (!start->done) {
+            start->abandoned = true;
+            start->future.cancel();
+            return false;
+        }
+
+        invocation->stream.flush();
+        out << invocation->output;
+
+        try {
+            if (start->exception) {
+                std::rethrow_exception(start->exception);
+            }
+
+            if (!command.invoke) {
+                start->future.waitForFinished();
+            }
+        } catch (...) {
+            capture();
+        }
+
+        if (!error && !command.invoke && start->future.isCanceled()) {
+            out << QConsole::colorize(QStringLiteral("Command canceled: %1").arg(command.name), QConsole::Color::Red,
+                                      QConsole::Style::Normal)
+                << Qt::endl;
+            canceled = true;
+        }
+    }
+
+#ifdef QCONSOLE_STATISTICS
+    node.statistics->record(timer, error || canceled);
+#endif
+
+    if (error) {
+        auto message = QStringLiteral("Command failed: %1").arg(command.name);
+
+        if (!error->isEmpty()) {
+            message.append(": ").append(*error);
+        }
+
+        out << QConsole::colorize(message, QConsole::Color::Red, QConsole::Style::Normal) << Qt::endl;
+    }
+
+    return !error && !canceled;
+}
+
+void QConsole::startJob(const std::string_view* tokens, size_t begin, size_t end, const Operator* operators,
+                        size_t count, QTextStream& out)
+{
+    std::vector<Operator> shifted(operators, operators + count);
+
+    for (auto& op : shifted) {
+        op.index -= begin;
+    }
+
+    std::shared_ptr<Job> job;
+
+    {
+        QMutexLocker locker(&m_jobsLock);
+
+        job = std::make_shared<Job>(++m_lastJobID, Arguments(tokens + begin, qsizetype(end - begin)),
+                                    std::move(shifted));
+        m_jobs.push_back(job);
+    }
+
+    // The output of the jobs started by a session is sent to the session, if it's still open.
+    if (m_session != nullptr) {
+        job->remote  = m_session->socket;
+        job->session = m_server != nullptr ? m_server->find(m_session) : nullptr;
+    }
+
+    out << QStringLiteral("[%1] %2").arg(job->id).arg(job->line) << Qt::endl;
+
+    m_jobPool->start([this, job]() {
+        {
+            QMutexLocker locker(&job->lock);
+            job->state = Job::State::Running;
+        }
+
+        const auto succeeded = !job->killed
+                            && runList(job->tokens.data(), 0, job->tokens.size(), job->operators.data(),
+                                       job->operators.size(), job->stream, false, job.get());
+
+        Job::State state;
+
+        {
+            QMutexLocker locker(&job->lock);
+            job->state = job->killed ? Job::State::Killed : succeeded ? Job::State::Done : Job::State::Failed;
+            state      = job->state;
+        }
+
+        job->send(*this, QStringLiteral("[%1] %2 %3\n").arg(job->id).arg(Job::name(state), -7).arg(job->line));
+        job->promise.finish();
+    });
+}
+
+void QConsole::timerEvent(QTimerEvent* event)
+{
+    Q_UNUSED(event);
+
+    mergeHistory();
+
+    // The text printed from then on is handed to the line editor by the printing threads. The queue
+    // is drained afterwards so that nothing printed before is left behind.
+    m_reading = m_terminalOutput;
+    drainOutput();
+
+    // Read user input...
+    const auto input = m_terminal->input(m_prompt);
+    m_reading        = false;
+
+    // Handle EOF (ctrl+d)
+    if (input == nullptr) {
+        return QCoreApplication::quit();
+    }
+
+    // The next line is read once the line is evaluated, even if it waits for commands.
+    if (const auto suspension = evaluateLine(input); suspension != nullptr) {
+        killTimer(m_timerID);
+        m_timerID = 0;
+
+        suspension->resume = [this]() {
+            if (m_running && m_timerID == 0) {
+                m_timerID = startTimer(0, Qt::TimerType::CoarseTimer);
+            }
+        };
+    }
+}
+
+void QConsole::readNextLine()
+{
+    if (m_reader != nullptr) {
+        mergeHistory();
+        m_reader->requestLine(m_prompt);
+    }
+}
+
+void QConsole::mergeHistory()
+{
+    if (m_history == nullptr) {
+        return;
+    }
+
+    std::vector<std::string> entries;
+    m_history->receive(entries);
+
+    for (auto& entry : entries) {
+        const auto separator = entry.find('\n');
+
+        if (separator == std::string::npos) {
+            continue;
+        }
+
+        auto text = entry.substr(separator + 1);
+        entry.resize(separator);
+
+        m_terminal->history_add(text);
+        m_historyIndex->add(std::move(entry), std::move(text));
+    }
+}
+
+void QConsole::setMaxHistorySize(int size)
+{
+    m_maxHistorySize = size;
+    m_terminal->set_max_history_size(size);
+
+    if (m_history != nullptr) {
+        m_history->setMaxSize(size);
+    }
+
+    m_historyIndex->setMaxSize(size);
+}
+
+void QConsole::setSharedHistory(bool shared)
+{
+    m_sharedHistory = shared;
+}
+
+void QConsole::addHistoryItem(const QString& item)
+{
+    if (const auto text = item.trimmed(); !text.isEmpty()) {
+        appendHistory(text.toStdString());
+    }
+}
+
+void QConsole::appendHistory(std::string&& text)
+{
+    auto timestamp = QDateTime::currentDateTime().toString(QStringLiteral("yyyy-MM-dd hh:mm:ss.zzz")).toStdString();
+
+    if (m_history != nullptr) {
+        m_history->append(timestamp + '\n' + text);
+    }
+
+    m_terminal->history_add(text);
+    m_historyIndex->add(std::move(timestamp), std::move(text));
+}
+
+QList<QString> QConsole::searchHistory(const QString& pattern, bool regex)
+{
+    QList<QString> items;
+
+    m_historyIndex->search(pattern.toStdString(), regex, [&items](qsizetype i, const HistoryIndex::Entry& entry) {
+        Q_UNUSED(i);
+        items.append(QString::fromStdString(entry.text));
+        return true;
+    });
+
+    return items;
+}
+
+void QConsole::setWordBreakCharacters(const char* characters)
+{
+    m_terminal->set_word_break_characters(characters);
+}
+
+void QConsole::setCompletionCountCutoff(int cutoff)
+{
+    m_terminal->set_completion_count_cutoff(cutoff);
+}
+
+void QConsole::setFuzzyCompletion(bool enable, int count)
+{
+    QMutexLocker locker(&m_completionLock);
+
+    m_fuzzyCompletion      = enable;
+    m_fuzzyCompletionCount = std::max(count, 0);
+}
+
+QList<QString> QConsole::complete(const QString& input)
+{
+    QList<QString>   list;
+    std::string_view prefix;
+
+    const auto str = input.toStdString();
+
+    for (const auto& name : findCompletions(str, prefix, true, true)) {
+        list.append(QString::fromStdString(name));
+    }
+
+    return list;
+}
+
+QString QConsole::hint(const QString& input)
+{
+    std::string hint;
+    int         length = 0;
+
+    return findHint(input.toStdString(), hint, length) ? QString::fromStdString(hint) : QString();
+}
+
+QString QConsole::highlight(const QString& input)
+{
+    // Each thread keeps its own tokens, so that highlighting a line edited since the previous call
+    // only re-lexes the edit.
+    thread_local Highlighter highlighter;
+
+    const auto       str = input.toStdString();
+    Replxx::colors_t colors(size_t(codePointCount(str)), Replxx::Color::DEFAULT);
+
+    highlighter.colorize(*this, str, colors);
+
+    QString result;
+    auto    last = Replxx::Color::DEFAULT;
+
+    // The colors are indexed by code point.
+    for (qsizetype i = 0, k = 0; i < input.size(); ++k) {
+        const auto color = size_t(k) < colors.size() ? colors[size_t(k)] : Replxx::Color::DEFAULT;
+        const auto code  = int(color);
+        const auto size  = input.at(i).isHighSurrogate() && i + 1 < input.size() ? 2 : 1;
+
+        if (color != last) {
+            result.append(code >= 0 && code < 16 ? QStringLiteral("\33[%1m").arg(code < 8 ? 30 + code : 82 + code)
+                                                 : QStringLiteral("\33[0m"));
+            last = color;
+        }
+
+        result.append(QStringView(input).mid(i, size));
+        i += size;
+    }
+
+    if (last != Replxx::Color::DEFAULT) {
+        result.append(QStringLiteral("\33[0m"));
+    }
+
+    return result;
+}
+
+void QConsole::setArgumentCompletionTimeout(int msecs)
+{
+    QMutexLocker locker(&m_completionLock);
+
+    m_argumentCompletionTimeout = msecs;
+}
+
+void QConsole::setDoubleTabCompletion(bool complete)
+{
+    m_terminal->set_double_tab_completion(complete);
+}
+
+void QConsole::setCompleteOnEmpty(bool complete)
+{
+    m_terminal->set_complete_on_empty(complete);
+}
+
+void QConsole::setBeepOnAmbiguousCompletion(bool beep)
+{
+    m_terminal->set_beep_on_ambiguous_completion(beep);
+}
+
+void QConsole::setNoColor(bool color)
+{
+    m_terminal->set_no_color(color);
+}
+
+void QConsole::setUniqueHistory(bool unique)
+{
+    m_terminal->set_unique_history(unique);
+    m_historyIndex->setUnique(unique);
+}
+
+size_t QConsole::commandCount()
+{
+    return m_registry->snapshot()->commandCount;
+}
+
+QList<QConsole::CommandStatistics> QConsole::commandStatistics()
+{
+    QList<CommandStatistics> list;
+
+    const std::function<void(const Node&)> collect = [&list, &collect](const Node& node) {
+        if (const auto& s = node.statistics; s && s->invocations > 0) {
+            list.append({ node.command.name, s->invocations, s->errors, s->percentile(0.5), s->percentile(0.99),
+                          s->max });
+        }
+
+        if (node.children) {
+            for (auto iter = node.children->begin(); iter != node.children->end(); ++iter) {
+                collect(iter.value());
+            }
+        }
+    };
+
+    const auto snapshot = m_registry->snapshot();
+    collect(snapshot->root);
+
+    std::sort(list.begin(), list.end(), [](const auto& a, const auto& b) { return a.name < b.name; });
+
+    return list;
+}
+
+void QConsole::resetCommandStatistics()
+{
+    const std::function<void(const Node&)> reset = [&reset](const Node& node) {
+        if (node.statistics) {
+            node.statistics->reset();
+        }
+
+        if (node.children) {
+            for (auto iter = node.children->begin(); iter != node.children->end(); ++iter) {
+                reset(iter.value());
+            }
+        }
+    };
+
+    const auto snapshot = m_registry->snapshot();
+    reset(snapshot->root);
+}
+
+void QConsole::addDefaultCommands()
+{
+    addCommand({
+      "exit",
+      "Exit the application, or close the session when invoked by a session.",
+      [](const Context& ctx) {
+          if (const auto session = ctx.console->m_session; session != nullptr) {
+              session->closing = true;
+          } else {
+              QCoreApplication::quit();
+          }
+      },
+      nullptr,
+      nullptr,
+      nullptr,
+      true,
+    });
+
+    addCommand({
+      "help",
+      "Print help information.",
+      [](const Context& ctx) {
+          auto& out = *ctx.output;
 
-using namespace replxx;
+          const auto group    = ctx.arguments.join(" ");
+          const auto snapshot = ctx.console->m_registry->snapshot();
+          const auto root     = ctx.console->findNode(*snapshot, group.toStdString());
 
-class QConsole::Trie : public tsl::htrie_map<char, QConsole::Command>
-{
-};
+          if (root == nullptr) {
+              out << QConsole::colorize(QStringLiteral("Command not found: ").append(group), QConsole::Color::Red,
+                                        QConsole::Style::Normal)
+                  << Qt::endl;
+              return;
+          }
 
-class QConsole::Terminal : public replxx::Replxx
-{
-};
+          ctx.console->page(ctx, [root](QTextStream& out) {
+              out << "\nList of commands:\n\n";
 
-QConsole::QConsole(QObject* parent)
-  : QObject(parent)
-  , m_commands(new Trie())
-  , m_terminal(new Terminal())
-  , m_echo(true)
-  , m_running(false)
-  , m_ostream(stdout)
-{
-    m_terminal->set_max_hint_rows(0);
-    m_terminal->bind_key_internal(Replxx::KEY::control('N'), "history_next");
-    m_terminal->bind_key_internal(Replxx::KEY::control('P'), "history_previous");
-    m_terminal->set_max_history_size(10000);
-    m_terminal->set_word_break_characters(" \t,%!;:=*~^'\"/?<>|[](){}");
-    m_terminal->set_completion_count_cutoff(256);
-    m_terminal->set_double_tab_completion(false);
-    m_terminal->set_complete_on_empty(true);
-    m_terminal->set_beep_on_ambiguous_completion(true);
-    m_terminal->set_no_color(false);
-    m_terminal->set_unique_history(true);
+              // Stop once the output fails (ex. the user quit the pager).
+              const std::function<void(const Node&)> print = [&out, &print](const Node& node) {
+                  if (out.status() != QTextStream::Ok) {
+                      return;
+                  }
 
-    m_terminal->set_hint_callback([this](std::string const& input, int& input_length, Replxx::Color& color) {
-        if (input_length > 0) {
-            if (const auto& pr = m_commands->equal_prefix_range(input); pr.first != pr.second) {
-                color = Replxx::Color::BROWN;
-                return Replxx::hints_t({ pr.first.key() });
-            }
-        }
+                  if (node.invokable || !node.command.description.isEmpty()) {
+                      out << QConsole::colorize(node.command.name, QConsole::Color::Green) << ": "
+                          << node.command.description << "\n";
+                  }
 
-        return Replxx::hints_t();
+                  if (node.children) {
+                      for (auto iter = node.children->begin(); iter != node.children->end(); ++iter) {
+                          print(iter.value());
+                      }
+                  }
+              };
+
+              print(*root);
+
+              out << "\nUsage: <command> [subcommands...] [arguments...]\n\n";
+              out.flush();
+          });
+      },
     });
 
-    m_terminal->set_completion_callback([this](const std::string& input, int& input_length) {
-        Q_UNUSED(input_length);
+    addCommand({
+      "history",
+      "Print command history. Use 'history <text>' or 'history -r <regex>' to only print the matches.",
+      [](const Context& ctx) {
+          auto& console = *ctx.console;
 
-        Replxx::completions_t completions;
+          console.mergeHistory();
 
-        const auto& pr = m_commands->equal_prefix_range(input);
-        for (auto iter = pr.first; iter != pr.second; ++iter) {
-            completions.emplace_back(Replxx::Completion(iter.key(), Replxx::Color::BROWN));
-        }
+          const auto regex   = ctx.arguments.size() > 1 && ctx.arguments.at(0) == "-r";
+          const auto pattern = regex ? ctx.arguments.toList().mid(1).join(" ") : ctx.arguments.join(" ");
 
-        return completions;
+          console.page(ctx, [&console, regex, &pattern](QTextStream& out) {
+              // Stop once the output fails (ex. the user quit the pager).
+              const auto print = [&out](qsizetype i, const std::string& timestamp, const std::string& text) {
+                  out << qSetFieldWidth(4) << i << qSetFieldWidth(0) << " "
+                      << QConsole::colorize(QString::fromStdString(timestamp), QConsole::Color::Blue) << " "
+                      << text.c_str() << "\n";
+
+                  return out.status() == QTextStream::Ok;
+              };
+
+              if (pattern.isEmpty()) {
+                  Replxx::HistoryScan hs(console.m_terminal->history_scan());
+
+                  for (auto i = 0; hs.next() && print(i, hs.get().timestamp(), hs.get().text()); i++) {
+                  }
+
+                  out.flush();
+                  return;
+              }
+
+              // The matches are printed as they are found.
+              const auto valid = console.m_historyIndex->search(
+                pattern.toStdString(), regex, [&print](qsizetype i, const HistoryIndex::Entry& entry) {
+                    return print(i, entry.timestamp, entry.text);
+                });
+
+              if (!valid) {
+                  out << QConsole::colorize(QStringLiteral("Invalid regular expression: ").append(pattern),
+                                            QConsole::Color::Red, QConsole::Style::Normal)
+                      << Qt::endl;
+              }
+
+              out.flush();
+          });
+      },
+      nullptr,
+      nullptr,
+      nullptr,
+      true,
     });
 
-    m_terminal->set_highlighter_callback([this](const std::string& input, Replxx::colors_t& colors) {
-        size_t prefixHighlightLength = 0;
-        size_t endOfWord = input.find(" "); // Check to see if we have multiple words (i.e. command + arguments)
+    addCommand({
+      "grep",
+      "Print the lines of the piped input matching a regular expression (ex. 'help | grep history').",
+      [](const Context& ctx) {
+          auto& out = *ctx.output;
 
-        if (endOfWord == std::string::npos) {
-            if (const auto c = findCommandByName(input); c != nullptr) {
-                prefixHighlightLength = input.length();
-            }
-        } else {
-            if (const auto c = findCommandByName(input.substr(0, endOfWord)); c != nullptr) {
-                prefixHighlightLength = endOfWord;
+          const auto               pattern = ctx.arguments.join(" ");
+          const QRegularExpression regex(pattern);
+
+          if (ctx.input == nullptr || pattern.isEmpty()) {
+              out << QConsole::colorize(QStringLiteral("Usage: <command> | grep <regex>"), QConsole::Color::Red,
+                                        QConsole::Style::Normal)
+                  << Qt::endl;
+              return;
+          }
+
+          if (!regex.isValid()) {
+              out << QConsole::colorize(QStringLiteral("Invalid regular expression: ").append(pattern),
+                                        QConsole::Color::Red, QConsole::Style::Normal)
+                  << Qt::endl;
+              return;
+          }
+
+          // The lines are matched without their colors, and printed as they come.
+          const QRegularExpression colors(QStringLiteral("\33\\[[0-9;]*m"));
+
+          while (!ctx.input->atEnd()) {
+              const auto line = QString::fromUtf8(ctx.input->readLine());
+
+              if (regex.match(QString(line).remove(colors)).hasMatch()) {
+                  out << line;
+              }
+          }
+
+          out.flush();
+      },
+    });
+
+    addCommand({
+      "more",
+      "Show the piped input one page at a time (ex. 'help | more'). Press space for the next page, enter for "
+      "the next line, '/' to search, and 'q' to quit.",
+      [](const Context& ctx) {
+          auto& out = *ctx.output;
+
+          if (ctx.input == nullptr) {
+              out << QConsole::colorize(QStringLiteral("Usage: <command> | more"), QConsole::Color::Red,
+                                        QConsole::Style::Normal)
+                  << Qt::endl;
+              return;
+          }
+
+          if (ctx.console->isPaged(out)) {
+              return Pager(*ctx.input, out).run();
+          }
+
+          // The input is copied as is when the output isn't the terminal.
+          while (!ctx.input->atEnd() && out.status() == QTextStream::Ok) {
+              out << QString::fromUtf8(ctx.input->readLine());
+          }
+
+          out.flush();
+      },
+    });
+
+    // Return the job with the specified id, or null after printing an error.
+    const auto findJob = [](const Context& ctx, std::string_view id) {
+        QMutexLocker locker(&ctx.console->m_jobsLock);
+
+        for (const auto& job : ctx.console->m_jobs) {
+            if (QByteArray::number(job->id) == QByteArray(id.data(), qsizetype(id.size()))) {
+                return job;
             }
         }
 
-        for (size_t i = 0; i < prefixHighlightLength; i++) {
-            colors.at(i) = Replxx::Color::BRIGHTGREEN;
-        }
+        const auto text = QString::fromUtf8(id.data(), qsizetype(id.size()));
+
+        *ctx.output << QConsole::colorize(QStringLiteral("No such job: ").append(text), QConsole::Color::Red,
+                                          QConsole::Style::Normal)
+                    << Qt::endl;
+
+        return std::shared_ptr<Job>();
+    };
+
+    addCommand({
+      "jobs",
+      "List the commands run in the background with '&' (ex. 'history &').",
+      [](const Context& ctx) {
+          std::vector<std::shared_ptr<Job>> jobs;
+
+          {
+              QMutexLocker locker(&ctx.console->m_jobsLock);
+              jobs = ctx.console->m_jobs;
+          }
+
+          std::vector<std::shared_ptr<Job>> finished;
+
+          for (const auto& job : jobs) {
+              Job::State state;
+
+              {
+                  QMutexLocker locker(&job->lock);
+                  state = job->state;
+              }
+
+              *ctx.output << QStringLiteral("[%1] %2 %3").arg(job->id).arg(Job::name(state), -7).arg(job->line)
+                          << Qt::endl;
+
+              if (state > Job::State::Running) {
+                  finished.push_back(job);
+              }
+          }
+
+          // The finished jobs are forgotten once they're listed.
+          QMutexLocker locker(&ctx.console->m_jobsLock);
+
+          for (const auto& job : finished) {
+              ctx.console->m_jobs.erase(std::find(ctx.console->m_jobs.begin(), ctx.console->m_jobs.end(), job));
+          }
+      },
     });
 
-    m_commands->burst_threshold(0);
-    m_commands->max_load_factor(1.0);
-}
+    addCommand({
+      "wait",
+      "Wait for the background jobs with the specified ids to finish, or for all of them.",
+      [findJob](const Context& ctx) {
+          auto& out = *ctx.output;
 
-void QConsole::start()
-{
-    if (!m_running) {
-        m_timerID = startTimer(0, Qt::TimerType::CoarseTimer);
-        m_running = true;
-        m_terminal->install_window_change_handler();
-    }
+          // A job waiting for the jobs could wait for itself.
+          if (QThread::currentThread() != ctx.console->thread()) {
+              out << QConsole::colorize(QStringLiteral("Jobs can't be waited for in the background"),
+                                        QConsole::Color::Red, QConsole::Style::Normal)
+                  << Qt::endl;
+              return;
+          }
+
+          std::vector<std::shared_ptr<Job>> jobs;
+
+          if (ctx.arguments.isEmpty()) {
+              QMutexLocker locker(&ctx.console->m_jobsLock);
+              jobs = ctx.console->m_jobs;
+          }
+
+          for (const auto& id : ctx.arguments) {
+              if (auto job = findJob(ctx, id); job != nullptr) {
+                  jobs.push_back(std::move(job));
+              }
+          }
+
+          // The rest of the line is evaluated once the jobs are finished, and the jobs are forgotten, as if
+          // they were listed.
+          QMutexLocker locker(&ctx.console->m_jobsLock);
+
+          for (const auto& job : jobs) {
+              ctx.console->m_awaited.push_back(job->future);
+
+              if (const auto i = std::find(ctx.console->m_jobs.begin(), ctx.console->m_jobs.end(), job);
+                  i != ctx.console->m_jobs.end()) {
+                  ctx.console->m_jobs.erase(i);
+              }
+          }
+      },
+    });
+
+    addCommand({
+      "kill",
+      "Stop the background jobs with the specified ids.",
+      [findJob](const Context& ctx) {
+          if (ctx.arguments.isEmpty()) {
+              *ctx.output << QConsole::colorize(QStringLiteral("Usage: kill <id>..."), QConsole::Color::Red,
+                                                QConsole::Style::Normal)
+                          << Qt::endl;
+              return;
+          }
+
+          // The jobs stop before their next command, and as soon as their current command checks its
+          // output.
+          for (const auto& id : ctx.arguments) {
+              if (const auto job = findJob(ctx, id); job != nullptr) {
+                  job->killed = true;
+              }
+          }
+      },
+    });
+
+    addCommand({
+      "clear",
+      "Clear the screen.",
+      [](const Context& ctx) {
+          ctx.console->m_terminal->clear_screen();
+      },
+      nullptr,
+      nullptr,
+      nullptr,
+      true,
+    });
+
+    addCommand({
+      "version",
+      "Print the application version.",
+      [](const Context& ctx) {
+          *ctx.output << QCoreApplication::applicationVersion() << Qt::endl;
+      },
+    });
+
+#ifdef QCONSOLE_STATISTICS
+    addCommand({
+      "stats",
+      "Print the invocation count, error count, and latencies of the commands.",
+      [](const Context& ctx) {
+          auto& out = *ctx.output;
+
+          const auto format = [](qint64 nanoseconds) {
+              if (nanoseconds < 1000) {
+                  return QStringLiteral("%1 ns").arg(nanoseconds);
+              } else if (nanoseconds < 1000000) {
+                  return QStringLiteral("%1 us").arg(double(nanoseconds) / 1e3, 0, 'f', 1);
+              } else if (nanoseconds < 1000000000) {
+                  return QStringLiteral("%1 ms").arg(double(nanoseconds) / 1e6, 0, 'f', 1);
+              }
+
+              return QStringLiteral("%1 s").arg(double(nanoseconds) / 1e9, 0, 'f', 2);
+          };
+
+          out << "\nCommand statistics:\n\n";
+
+          for (const auto& s : ctx.console->commandStatistics()) {
+              out << QConsole::colorize(s.name, QConsole::Color::Green) << ": " << s.invocations << " calls, "
+                  << s.errors << " errors, p50 " << format(s.p50) << ", p99 " << format(s.p99) << ", max "
+                  << format(s.max) << "\n";
+          }
+
+          out << "\n";
+          out.flush();
+      },
+    });
+
+    addCommand({
+      "stats reset",
+      "Forget the invocations recorded so far.",
+      [](const Context& ctx) {
+          ctx.console->resetCommandStatistics();
+      },
+    });
+#endif
 }
 
-void QConsole::stop()
+// Return the name with its words separated by single spaces.
+static QString normalizeName(const QString& name)
 {
-    if (m_running) {
-        killTimer(m_timerID);
-        m_running = false;
+    if (!name.startsWith(' ') && !name.endsWith(' ') && !name.contains(QLatin1String("  "))) {
+        return name;
     }
+
+    return name.split(' ', Qt::SkipEmptyParts).join(' ');
 }
 
-bool QConsole::running()
+void QConsole::addCommand(const Command& command)
 {
-    return m_running;
+    addCommand(Command(command));
 }
 
-QConsole::~QConsole()
+void QConsole::addCommand(Command&& command)
 {
-    if (m_running) {
-        m_terminal->invoke(Replxx::ACTION::CLEAR_SELF, 0);
-    }
+    command.name = normalizeName(command.name);
 
-    if (!m_historyFilePath.empty()) {
-        m_terminal->history_save(m_historyFilePath);
+    if (command.name.isEmpty()) {
+        return;
     }
 
-    if (!m_echo) {
-        setStdinEcho(true);
-    }
+    const auto name = command.name.toUtf8();
 
-    delete m_terminal;
-    delete m_commands;
-}
+    QMutexLocker locker(&m_registry->commandsLock);
+    QMutexLocker lazyLocker(&m_registry->lazyLock);
 
-void QConsole::setOutputDevice(QIODevice* device)
-{
-    m_ostream.device()->close();
-    m_ostream.setDevice(device);
+    insertCommand(std::move(command), std::string_view(name.constData(), size_t(name.size())));
+
+    m_registry->invalidateTables(std::string_view(name.constData(), size_t(name.size())));
+    m_registry->changed();
 }
 
-bool QConsole::invokeCommandByName(const QString& name, const Context& ctx)
+void QConsole::addCommands(std::vector<Command> commands)
 {
-    if (const auto c = findCommandByName(name.toStdString()); c != nullptr) {
-        c->invoke(ctx);
-        return true;
+    // Prepare the names before taking the lock so that the other writers are only blocked while
+    // inserting.
+    std::vector<std::pair<QByteArray, Command*>> entries;
+    entries.reserve(commands.size());
+
+    for (auto& command : commands) {
+        command.name = normalizeName(command.name);
+
+        if (!command.name.isEmpty()) {
+            entries.emplace_back(command.name.toUtf8(), &command);
+        }
     }
 
-    return false;
+    // Sort the names word by word, so that the commands of each group are next to each other and
+    // its children are modified once. The sort is stable so that the last of the commands with the
+    // same name wins, as when they're added one by one.
+    std::stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+        return std::lexicographical_compare(a.first.begin(), a.first.end(), b.first.begin(), b.first.end(),
+                                            [](char x, char y) {
+                                                return (x == ' ' ? 0 : int(uchar(x)) + 1)
+                                                       < (y == ' ' ? 0 : int(uchar(y)) + 1);
+                                            });
+    });
+
+    // The commands are published at once: readers see either none or all of them, and the caches
+    // and perfect hash tables are invalidated once.
+    QMutexLocker locker(&m_registry->commandsLock);
+    QMutexLocker lazyLocker(&m_registry->lazyLock);
+
+    if (!entries.empty()) {
+        insertCommands(m_registry->commands, entries.data(), entries.data() + entries.size(), 0);
+    }
+
+    m_registry->changed();
 }
 
-void QConsole::evaluateLine(const char* line)
+void QConsole::insertCommand(Command&& command, std::string_view name)
 {
-    const auto a = QString(line).trimmed();
+    Node*  node  = m_registry->commands;
+    size_t start = 0;
 
-    if (a.isEmpty()) {
-        return;
-    }
+    while (start < name.size()) {
+        auto end = name.find(' ', start);
 
-    const auto tokens = a.split(' ');
-    const auto name   = tokens[0].toStdString();
+        if (end == std::string_view::npos) {
+            end = name.size();
+        }
+
+        auto&      children = node->detachChildren();
+        const auto key      = name.substr(start, end - start);
+        auto       iter     = children.find_ks(key.data(), key.size());
 
-    m_terminal->history_add(a.toStdString());
+        if (iter == children.end()) {
+            const auto path = end == name.size() ? command.name : QString::fromUtf8(name.data(), qsizetype(end));
+
+            iter = children.insert_ks(key.data(), key.size(), Node{ Command{ path } }).first;
+            node->fuzzy.reset();
+        }
 
-    if (const auto c = findCommandByName(name); c != nullptr) {
-        return c->invoke(Context{ tokens.mid(1) });
+        node  = &iter.value();
+        start = end + 1;
     }
 
-    m_ostream << QConsole::colorize(QStringLiteral("Command not found: ").append(tokens[0]), QConsole::Color::Red,
-                                    QConsole::Style::Normal)
-              << Qt::endl;
+    assignCommand(*node, std::move(command));
 }
 
-void QConsole::timerEvent(QTimerEvent* event)
+void QConsole::insertCommands(Node* node, std::pair<QByteArray, Command*>* begin, std::pair<QByteArray, Command*>* end,
+                              size_t offset)
 {
-    Q_UNUSED(event);
+    // The names of the range are sorted and start with the path of the node, which is "offset"
+    // bytes long with the trailing space. Each run of names sharing their next word goes to the
+    // same child.
+    const auto word = [offset](const std::pair<QByteArray, Command*>& entry) {
+        const auto name  = std::string_view(entry.first.constData(), size_t(entry.first.size()));
+        const auto space = name.find(' ', offset);
 
-    // Read user input...
-    const auto input = m_terminal->input(m_prompt);
+        return name.substr(offset, space == std::string_view::npos ? std::string_view::npos : space - offset);
+    };
 
-    // Handle EOF (ctrl+d)
-    if (input == nullptr) {
-        QCoreApplication::quit();
+    auto& children = node->detachChildren();
+
+    for (auto run = begin; run != end;) {
+        const auto key  = word(*run);
+        auto       last = run;
+
+        while (last != end && word(*last) == key) {
+            ++last;
+        }
+
+        auto iter = children.find_ks(key.data(), key.size());
+
+        if (iter == children.end()) {
+            const auto path = QString::fromUtf8(run->first.constData(), qsizetype(offset + key.size()));
+
+            iter = children.insert_ks(key.data(), key.size(), Node{ Command{ path } }).first;
+            node->fuzzy.reset();
+        }
+
+        // The names ending with the word sort first.
+        auto child = &iter.value();
+
+        for (; run != last && size_t(run->first.size()) == offset + key.size(); ++run) {
+            assignCommand(*child, std::move(*run->second));
+        }
+
+        if (run != last) {
+            insertCommands(child, run, last, offset + key.size() + 1);
+        }
+
+        run = last;
     }
 
-    return evaluateLine(input);
+    m_registry->invalidateTable(std::string_view(begin->first.constData(), offset > 0 ? offset - 1 : 0));
 }
 
-void QConsole::setMaxHistorySize(int size)
+void QConsole::assignCommand(Node& node, Command&& command)
 {
-    m_terminal->set_max_history_size(size);
-}
+    if (command.invoke || command.invokeAsync) {
+        m_registry->commandCount += node.invokable ? 0 : 1;
 
-void QConsole::setWordBreakCharacters(const char* characters)
-{
-    m_terminal->set_word_break_characters(characters);
-}
+        node.command   = std::move(command);
+        node.invokable = true;
 
-void QConsole::setCompletionCountCutoff(int cutoff)
-{
-    m_terminal->set_completion_count_cutoff(cutoff);
+#ifdef QCONSOLE_STATISTICS
+        if (!node.statistics) {
+            node.statistics = std::make_shared<Statistics>();
+        }
+#endif
+    } else {
+        node.command.description = std::move(command.description);
+    }
 }
 
-void QConsole::setDoubleTabCompletion(bool complete)
+void QConsole::addCommandSource(const CommandSource& source)
 {
-    m_terminal->set_double_tab_completion(complete);
-}
+    QMutexLocker locker(&m_registry->commandsLock);
 
-void QConsole::setCompleteOnEmpty(bool complete)
-{
-    m_terminal->set_complete_on_empty(complete);
-}
+    {
+        QMutexLocker sourceLocker(&m_registry->sources.lock);
 
-void QConsole::setBeepOnAmbiguousCompletion(bool beep)
-{
-    m_terminal->set_beep_on_ambiguous_completion(beep);
+        auto sources = std::make_shared<std::vector<CommandSource>>(*m_registry->sources.sources);
+        sources->push_back(source);
+
+        m_registry->sources.sources = std::move(sources);
+        m_registry->sources.answers = std::make_shared<SourceCache::Answers>();
+        m_registry->sources.available.store(true, std::memory_order_release);
+    }
+
+    if (!source.paths.isEmpty()) {
+        m_registry->sources.watcher.addPaths(source.paths);
+    }
+
+    m_registry->changed();
 }
 
-void QConsole::setNoColor(bool color)
+void QConsole::refreshCommandSources()
 {
-    m_terminal->set_no_color(color);
+    m_registry->refreshSources();
 }
 
-void QConsole::setUniqueHistory(bool unique)
+void QConsole::removeCommandByName(const QString& name)
 {
-    m_terminal->set_unique_history(unique);
-}
+    QMutexLocker locker(&m_registry->commandsLock);
+
+    const auto words = name.split(' ', Qt::SkipEmptyParts);
+
+    if (words.isEmpty()) {
+        return;
+    }
+
+    // Check that the command exists before detaching the children on its path.
+    const Node* existing = m_registry->commands;
+
+    for (const auto& word : words) {
+        if (!existing->children) {
+            return;
+        }
 
-size_t QConsole::commandCount()
-{
-    return m_commands->size();
-}
+        const auto iter = existing->children->find(word.toStdString());
 
-void QConsole::addDefaultCommands()
-{
-    addCommand({
-      "exit",
-      "Exit the application.",
-      [](const Context& ctx) {
-          Q_UNUSED(ctx);
-          QCoreApplication::quit();
-      },
-    });
+        if (iter == existing->children->end()) {
+            return;
+        }
 
-    addCommand({
-      "help",
-      "Print help information.",
-      [this](const Context& ctx) {
-          Q_UNUSED(ctx);
+        existing = &iter.value();
+    }
 
-          m_ostream << "\nList of commands:\n\n";
+    QMutexLocker lazyLocker(&m_registry->lazyLock);
 
-          for (auto iter = m_commands->begin(); iter != m_commands->end(); ++iter) {
-              m_ostream << QConsole::colorize(iter->name, QConsole::Color::Green) << ": " << iter->description << "\n";
-          }
+    std::vector<Node*> path = { m_registry->commands };
 
-          m_ostream << "\nUsage: <command> [arguments...]\n\n";
-          m_ostream.flush();
-      },
-    });
+    for (const auto& word : words) {
+        path.push_back(&path.back()->detachChildren().find(word.toStdString()).value());
+    }
 
-    addCommand({
-      "history",
-      "Print command history.",
-      [this](const Context& ctx) {
-          Q_UNUSED(ctx);
+    auto node = path.back();
 
-          Replxx::HistoryScan hs(m_terminal->history_scan());
+    m_registry->commandCount -= node->invokable ? 1 : 0;
 
-          for (auto i = 0; hs.next(); i++) {
-              m_ostream << qSetFieldWidth(4) << i << qSetFieldWidth(0) << " "
-                        << QConsole::colorize(QString::fromStdString(hs.get().timestamp()), QConsole::Color::Blue)
-                        << " " << hs.get().text().c_str() << "\n";
-          }
+    node->command   = Command{ node->command.name };
+    node->invokable = false;
+    node->statistics.reset();
 
-          m_ostream.flush();
-      },
-    });
+    // Remove the nodes that are neither a command nor a group anymore, starting from the leaf.
+    for (auto i = words.size(); i > 0; --i) {
+        if (const auto n = path[i]; n->invokable || (n->children && !n->children->empty())) {
+            break;
+        }
 
-    addCommand({
-      "clear",
-      "Clear the screen.",
-      [this](const Context& ctx) {
-          Q_UNUSED(ctx);
-          m_terminal->clear_screen();
-      },
-    });
+        path[i - 1]->children->erase(words[i - 1].toStdString());
+        path[i - 1]->fuzzy.reset();
+    }
 
-    addCommand({
-      "version",
-      "Print the application version.",
-      [](const Context& ctx) {
-          Q_UNUSED(ctx);
-          QTextStream(stdout) << QCoreApplication::applicationVersion() << Qt::endl;
-      },
-    });
+    m_registry->invalidateTables(words.join(' ').toStdString());
+    m_registry->changed();
 }
 
-void QConsole::addCommand(const Command& c)
+void QConsole::freezeCommands()
 {
-    m_commands->insert(c.name.toStdString(), c);
+    QMutexLocker locker(&m_registry->commandsLock);
+    QMutexLocker lazyLocker(&m_registry->lazyLock);
+
+    m_registry->commands->freeze(true);
+    m_registry->frozen      = true;
+    m_registry->frozenDirty = false;
+    m_registry->dirtyGroups.clear();
+    m_registry->changed();
 }
 
-void QConsole::removeCommandByName(const QString& name)
+void QConsole::unfreezeCommands()
 {
-    m_commands->erase(name.toStdString());
+    QMutexLocker locker(&m_registry->commandsLock);
+    QMutexLocker lazyLocker(&m_registry->lazyLock);
+
+    m_registry->commands->freeze(false);
+    m_registry->frozen      = false;
+    m_registry->frozenDirty = false;
+    m_registry->dirtyGroups.clear();
+    m_registry->changed();
+}
+
+void QConsole::refreezeCommands()
+{
+    // The tables are only rebuilt from the console thread; the snapshots published in the meantime
+    // fall back to the tries. Only the tables of the groups whose children changed are rebuilt: the
+    // others still point into children that weren't modified, which the copies of their nodes share.
+    if (m_registry->frozenDirty.load(std::memory_order_relaxed)) {
+        QMutexLocker locker(&m_registry->commandsLock);
+        QMutexLocker lazyLocker(&m_registry->lazyLock);
+
+        if (m_registry->frozenDirty) {
+            for (const auto& path : m_registry->dirtyGroups) {
+                if (const auto node = m_registry->findGroup(path); node != nullptr) {
+                    node->refreeze();
+                }
+            }
+
+            m_registry->dirtyGroups.clear();
+            m_registry->frozenDirty = false;
+            m_registry->changed();
+        }
+    }
 }
 
 void QConsole::setPrompt(const QString& prompt)
 {
-    m_prompt = prompt.toStdString();
+    (m_session != nullptr ? m_session->prompt : m_prompt) = prompt.toStdString();
 }
 
 void QConsole::setDefaultPrompt(const QString& prompt)
 {
-    m_defaultPrompt = prompt.toStdString();
-    m_prompt        = m_defaultPrompt;
+    m_defaultPrompt                                       = prompt.toStdString();
+    (m_session != nullptr ? m_session->prompt : m_prompt) = m_defaultPrompt;
 }
 
 void QConsole::resetPrompt()
 {
-    m_prompt = m_defaultPrompt;
+    (m_session != nullptr ? m_session->prompt : m_prompt) = m_defaultPrompt;
 }
 
 const QString QConsole::historyFilePath()
@@ -361,7 +5633,7 @@ const QString QConsole::defaultPrompt()
 
 const QString QConsole::prompt()
 {
-    return QString::fromStdString(m_prompt);
+    return QString::fromStdString(m_session != nullptr ? m_session->prompt : m_prompt);
 }
 
 void QConsole::setHistoryFilePath(const QString& path)
@@ -376,9 +5648,46 @@ void QConsole::setHistoryFilePath(const QString& path)
         f.close();
     }
 
+    if (m_history != nullptr) {
+        m_history->stop();
+        delete m_history;
+    }
+
     m_historyFilePath = path.toStdString();
+    m_history         = new HistoryStore();
+
+    // Journals are loaded from their newest records only, so that startup doesn't depend on the
+    // size of the file.
+    if (std::string entries; m_history->open(path, m_maxHistorySize, m_sharedHistory, entries)) {
+        std::istringstream in(entries);
+        m_terminal->history_load(in);
+        m_history->start();
+    } else {
+        // Convert history files written by previous versions.
+        m_terminal->history_load(m_historyFilePath);
+
+        std::vector<std::string> entries;
+        Replxx::HistoryScan      hs(m_terminal->history_scan());
+
+        while (hs.next()) {
+            entries.push_back(hs.get().timestamp() + '\n' + hs.get().text());
+        }
 
-    m_terminal->history_load(m_historyFilePath);
+        if (m_history->rewrite(entries)) {
+            m_history->start();
+        } else {
+            delete m_history;
+            m_history = nullptr;
+        }
+    }
+
+    m_historyIndex->clear();
+
+    Replxx::HistoryScan hs(m_terminal->history_scan());
+
+    while (hs.next()) {
+        m_historyIndex->add(hs.get().timestamp(), hs.get().text());
+    }
 }
 
 void QConsole::setStdinEcho(bool enable)
@@ -441,12 +5750,453 @@ QTextStream& QConsole::ostream()
     return m_ostream;
 }
 
-const QConsole::Command* QConsole::findCommandByName(std::string_view name)
+void QConsole::page(const Context& ctx, const std::function<void(QTextStream& out)>& producer)
+{
+    auto& out = ctx.output != nullptr ? *ctx.output : m_ostream;
+
+    if (!isPaged(out)) {
+        return producer(out);
+    }
+
+    // The pipe holds a single chunk so that the producer doesn't get far ahead of the pages shown.
+    Pipe        pipe(1);
+    QTextStream stream(pipe.sink());
+
+    std::exception_ptr exception;
+    QSemaphore         finished;
+
+    // The producer runs on the thread kept by the pager pool from one page to the next.
+    m_pagerPool->start([&producer, &pipe, &stream, &exception, &finished]() {
+        try {
+            producer(stream);
+        } catch (...) {
+            exception = std::current_exception();
+        }
+
+        stream.flush();
+        pipe.closeWrite();
+        finished.release();
+    });
+
+    Pager(pipe, out).run();
+
+    // The writes of the producer fail from now on, so that it stops if the user quit early.
+    pipe.closeRead();
+    finished.acquire();
+
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+void QConsole::setPaging(bool enable)
+{
+    m_paging = enable;
+}
+
+// Check if the output written to the stream can be paged: it's written to the terminal the user is
+// typing in, from the console thread. The prompt timer is stopped while a line waits for commands,
+// so the input mode tells whether the user is typing.
+bool QConsole::isPaged(const QTextStream& out)
+{
+#ifdef Q_OS_WIN32
+    const bool interactive = _isatty(_fileno(stdin)) && _isatty(_fileno(stdout));
+#else
+    const bool interactive = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+#endif
+
+    return m_paging && interactive && &out == &m_ostream && m_terminalOutput && m_session == nullptr && m_running
+        && m_inputMode != InputMode::Batch && QThread::currentThread() == thread();
+}
+
+const QConsole::Node* QConsole::findChild(const Snapshot& snapshot, const Node& node, std::string_view name,
+                                          bool resolve)
+{
+    const Node* child = nullptr;
+
+    if (snapshot.frozen && node.frozen) {
+        child = node.frozen->find(name);
+    } else if (node.children) {
+        if (const auto& iter = node.children->find_ks(name.data(), name.size()); iter != node.children->end()) {
+            child = &iter.value();
+        }
+    }
+
+    // The command sources provide the top-level names no registered command knows.
+    if (child == nullptr && &node == &snapshot.root) {
+        child = findSourceCommand(snapshot, name, resolve);
+    }
+
+    return child;
+}
+
+const QConsole::Node* QConsole::findSourceCommand(const Snapshot& snapshot, std::string_view name, bool resolve)
+{
+    if (!m_registry->sources.available.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+
+    auto&      answers = *snapshot.sources;
+    const auto key     = QString::fromUtf8(name.data(), qsizetype(name.size()));
+
+    if (const auto table = std::atomic_load(&answers.table); table->commands.contains(key)) {
+        return table->commands.value(key).get();
+    } else if (!resolve || table->misses.contains(key)) {
+        return nullptr;
+    }
+
+    // The sources may be slow (ex. scanning directories), so the other lookups don't wait for them.
+    std::shared_ptr<Node> node;
+
+    for (const auto& source : *sourceList()) {
+        if (!source.find) {
+            continue;
+        }
+
+        if (auto command = source.find(key)) {
+            node               = std::make_shared<Node>();
+            node->command      = std::move(*command);
+            node->command.name = key;
+            node->invokable    = true;
+#ifdef QCONSOLE_STATISTICS
+            node->statistics = std::make_shared<Statistics>();
+#endif
+            break;
+        }
+    }
+
+    QMutexLocker locker(&m_registry->sources.lock);
+
+    // Another thread may have answered in the meantime; its command is kept since it may be in use.
+    if (const auto iter = answers.table->commands.constFind(key); iter != answers.table->commands.constEnd()) {
+        return iter.value().get();
+    }
+
+    auto table = std::make_shared<SourceCache::Table>(*answers.table);
+
+    if (node) {
+        table->commands.insert(key, node);
+    } else {
+        if (table->misses.size() >= SourceCache::MaxMisses) {
+            table->misses.clear();
+        }
+
+        table->misses.insert(key);
+    }
+
+    std::atomic_store(&answers.table, std::shared_ptr<const SourceCache::Table>(std::move(table)));
+
+    return node.get();
+}
+
+bool QConsole::isSourceAnswered(const Snapshot& snapshot, std::string_view name)
+{
+    if (!m_registry->sources.available.load(std::memory_order_acquire)) {
+        return true;
+    }
+
+    const auto key   = QString::fromUtf8(name.data(), qsizetype(name.size()));
+    const auto table = std::atomic_load(&snapshot.sources->table);
+
+    return table->commands.contains(key) || table->misses.contains(key);
+}
+
+QList<QString> QConsole::findSourceCompletions(const Snapshot& snapshot, std::string_view prefix, bool resolve)
+{
+    if (!m_registry->sources.available.load(std::memory_order_acquire)) {
+        return QList<QString>();
+    }
+
+    auto&      answers = *snapshot.sources;
+    const auto key     = QString::fromUtf8(prefix.data(), qsizetype(prefix.size()));
+
+    if (const auto table = std::atomic_load(&answers.table); table->completions.contains(key) || !resolve) {
+        return table->completions.value(key);
+    }
+
+    QList<QString> names;
+
+    for (const auto& source : *sourceList()) {
+        if (source.complete) {
+            names.append(source.complete(key));
+        }
+    }
+
+    names.removeDuplicates();
+    std::sort(names.begin(), names.end());
+
+    QMutexLocker locker(&m_registry->sources.lock);
+
+    auto table = std::make_shared<SourceCache::Table>(*answers.table);
+    table->completions.insert(key, names);
+
+    std::atomic_store(&answers.table, std::shared_ptr<const SourceCache::Table>(std::move(table)));
+
+    return names;
+}
+
+std::shared_ptr<const std::vector<QConsole::CommandSource>> QConsole::sourceList()
+{
+    QMutexLocker locker(&m_registry->sources.lock);
+
+    return m_registry->sources.sources;
+}
+
+const QConsole::Node* QConsole::findNode(const Snapshot& snapshot, std::string_view path)
+{
+    const Node* node  = &snapshot.root;
+    size_t      start = 0;
+
+    while (node != nullptr && start < path.size()) {
+        auto end = path.find(' ', start);
+
+        if (end == std::string_view::npos) {
+            end = path.size();
+        }
+
+        if (end > start) {
+            node = findChild(snapshot, *node, path.substr(start, end - start), true);
+        }
+
+        start = end + 1;
+    }
+
+    return node;
+}
+
+const QConsole::Node* QConsole::findCompletionNode(const Snapshot& snapshot, std::string_view input,
+                                                   std::string_view& prefix, std::string_view& arguments, bool resolve)
+{
+    // Every word but the last one must name a group; the last word is the prefix to complete. Past
+    // the name of a command, the words are its arguments.
+    const auto last = input.rfind(' ');
+
+    arguments = std::string_view();
+    prefix    = last == std::string_view::npos ? input : input.substr(last + 1);
+
+    const Node* node  = &snapshot.root;
+    size_t      start = 0;
+
+    while (last != std::string_view::npos && start < last) {
+        const auto end = input.find(' ', start);
+
+        if (end > start) {
+            const auto child = findChild(snapshot, *node, input.substr(start, end - start), resolve);
+
+            if (child == nullptr) {
+                if (!node->invokable) {
+                    return nullptr;
+                }
+
+                arguments = input.substr(start, last - start);
+                return node;
+            }
+
+            node = child;
+        }
+
+        start = end + 1;
+    }
+
+    return node;
+}
+
+std::vector<std::string> QConsole::findCompletions(std::string_view input, std::string_view& prefix, bool fuzzy,
+                                                  bool wait, size_t limit)
+{
+    const auto snapshot = m_registry->snapshot();
+
+    std::vector<std::string> completions;
+    std::string_view         arguments;
+
+    // The hints don't wait for the argument completions, nor ask the command sources.
+    const auto node = findCompletionNode(*snapshot, lastCommand(input), prefix, arguments, wait);
+
+    if (node == nullptr) {
+        return completions;
+    }
+
+    if (node->invokable && (!arguments.empty() || !node->children)) {
+        if (!node->command.complete) {
+            return completions;
+        }
+
+        return findArgumentCompletions(node->command, arguments, prefix, wait, limit);
+    }
+
+    if (!node->children && node != &snapshot->root) {
+        return completions;
+    }
+
+    // The cache may be used concurrently by the reader thread and the console thread.
+    QMutexLocker locker(&m_completionLock);
+
+    if (node->children) {
+        findNameCompletions(*snapshot, *node, prefix, fuzzy, limit, completions);
+    }
+
+    // The command sources complete the top-level names after the registered commands.
+    if (node == &snapshot->root && completions.size() < limit) {
+        for (const auto& name : findSourceCompletions(*snapshot, prefix, wait)) {
+            auto str = name.toStdString();
+
+            if (!node->children || node->children->find(str) == node->children->end()) {
+                completions.push_back(std::move(str));
+            }
+
+            if (completions.size() == limit) {
+                break;
+            }
+        }
+    }
+
+    return completions;
+}
+
+void QConsole::findNameCompletions(const Snapshot& snapshot, const Node& node, std::string_view prefix, bool fuzzy,
+                                   size_t limit, std::vector<std::string>& completions)
+{
+    fuzzy = fuzzy && m_fuzzyCompletion && !prefix.empty();
+
+    auto&      entry  = fuzzy ? m_completionCache->fuzzy : m_completionCache->prefix;
+    const bool narrow = entry.contains(&node, snapshot.generation, prefix);
+
+    entry.node       = &node;
+    entry.generation = snapshot.generation;
+    entry.prefix.assign(prefix);
+
+    if (fuzzy) {
+        auto index = std::atomic_load(&node.fuzzy);
+
+        // The index is shared by the snapshots holding the node, so it's built once.
+        if (!index) {
+            QMutexLocker locker(&m_registry->lazyLock);
+
+            if (index = node.fuzzy; !index) {
+                index = std::make_shared<FuzzyIndex>(*node.children);
+                std::atomic_store(&node.fuzzy, index);
+            }
+        }
+
+        index->match(prefix, std::min(limit, size_t(m_fuzzyCompletionCount)), entry.candidates, narrow,
+                          completions);
+        return;
+    }
+
+    if (narrow) {
+        entry.names.erase(std::remove_if(entry.names.begin(), entry.names.end(),
+                                         [prefix](const std::string& name) {
+                                             return name.compare(0, prefix.size(), prefix) != 0;
+                                         }),
+                          entry.names.end());
+    } else {
+        entry.names.clear();
+
+        const auto& pr = node.children->equal_prefix_range_ks(prefix.data(), prefix.size());
+
+        for (auto iter = pr.first; iter != pr.second; ++iter) {
+            entry.names.emplace_back(iter.key());
+        }
+    }
+
+    completions.assign(entry.names.begin(), entry.names.begin() + std::min(limit, entry.names.size()));
+}
+
+std::vector<std::string> QConsole::findArgumentCompletions(const Command& command, std::string_view arguments,
+                                                          std::string_view prefix, bool wait, size_t limit)
+{
+    std::vector<std::string> completions;
+
+    const auto words = QString::fromUtf8(arguments.data(), qsizetype(arguments.size())).split(' ', Qt::SkipEmptyParts);
+    const auto text  = QString::fromUtf8(prefix.data(), qsizetype(prefix.size()));
+    const auto key   = QStringLiteral("%1\n%2\n%3").arg(command.name).arg(words.size()).arg(text);
+
+    QList<QString>                     results;
+    std::shared_ptr<PendingCompletion> pending;
+    int                                timeout = 0;
+
+    {
+        QMutexLocker locker(&m_completionLock);
+
+        timeout = wait ? m_argumentCompletionTimeout : 0;
+
+        if (const auto iter = m_argumentCompletions.constFind(key); iter != m_argumentCompletions.constEnd()) {
+            results = iter.value();
+        } else if (m_pendingCompletion && m_pendingCompletion->key == key) {
+            pending = m_pendingCompletion;
+        } else {
+            // The user kept typing, so the previous request is stale.
+            if (m_pendingCompletion) {
+                m_pendingCompletion->request.cancel();
+            }
+
+            pending = m_pendingCompletion =
+              std::make_shared<PendingCompletion>(key, words, text, m_argumentCompletionTimeout);
+
+            m_completionPool->start([this, pending, provider = command.complete]() {
+                QList<QString> list;
+
+                // Completion is best effort, so failing providers just don't offer anything. Requests
+                // canceled while they were queued are dropped.
+                try {
+                    if (!pending->request.isCanceled()) {
+                        list = provider(pending->request);
+                    }
+                } catch (...) {
+                }
+
+                QMutexLocker locker(&m_completionLock);
+
+                pending->results = list;
+
+                if (!pending->request.isCanceled()) {
+                    m_argumentCompletions.insert(pending->key, list);
+                }
+
+                if (m_pendingCompletion == pending) {
+                    m_pendingCompletion.reset();
+                }
+
+                locker.unlock();
+                pending->finished.release();
+            });
+        }
+    }
+
+    if (pending && timeout > 0 && pending->finished.tryAcquire(1, timeout)) {
+        pending->finished.release();
+        results = pending->results;
+    }
+
+    for (qsizetype i = 0; i < results.size() && completions.size() < limit; ++i) {
+        completions.push_back(results[i].toStdString());
+    }
+
+    return completions;
+}
+
+bool QConsole::findHint(std::string_view input, std::string& hint, int& length)
 {
-    const auto& iter = m_commands->longest_prefix(name);
+    std::string_view prefix;
+
+    if (input.empty() || input.back() == ' ') {
+        return false;
+    }
+
+    if (auto completions = findCompletions(input, prefix, false, false, 1);
+        !completions.empty() && !prefix.empty() && completions.front().compare(0, prefix.size(), prefix) == 0) {
+        hint   = std::move(completions.front());
+        length = codePointCount(prefix);
+        return true;
+    }
 
-    if (iter != m_commands->end() && iter.key().length() == name.size()) {
-        return &iter.value();
+    return false;
+}
+
+const QConsole::Node* QConsole::findCommandByName(const Snapshot& snapshot, std::string_view name)
+{
+    if (const auto node = findNode(snapshot, name); node != nullptr && node->invokable) {
+        return node;
     }
 
     return nullptr;
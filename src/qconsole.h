@@ -23,9 +23,23 @@
 
 #pragma once
 
+#include <QtCore/QDeadlineTimer>
+#include <QtCore/QFuture>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
 #include <QtCore/QObject>
+#include <QtCore/QPointer>
 #include <QtCore/QString>
 #include <QtCore/QTextStream>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class QThreadPool;
 
 // QConsole is the access point to our REPL session and the terminal. It provides
 // the ability to add and remove invokable commands.
@@ -52,17 +66,182 @@ public:
         Bold   = 1
     };
 
+    // InputMode represents the way user input is read from stdin.
+    enum class InputMode
+    {
+        // Read user input from a timer on the console thread. The event loop is blocked
+        // while the user is typing.
+        Blocking = 0,
+
+        // Read user input on a dedicated thread and evaluate completed lines on the console
+        // thread as queued events. The event loop keeps running while the user is typing.
+        Asynchronous = 1,
+
+        // Evaluate every line read from stdin without the line editor and quit at the end of the
+        // input. This mode is used automatically when stdin isn't a terminal.
+        Batch = 2,
+    };
+
+    // Arguments is a view of the arguments used to invoke a command. The arguments are borrowed
+    // from the evaluated line, so they are only valid until the command returns, and they are
+    // converted to QString only on request.
+    class Arguments
+    {
+    public:
+        Arguments() = default;
+
+        Arguments(const std::string_view* data, qsizetype size)
+          : m_data(data)
+          , m_size(size)
+        {
+        }
+
+        // Return the number of arguments.
+        qsizetype size() const
+        {
+            return m_size;
+        }
+
+        // Check if there are no arguments.
+        bool isEmpty() const
+        {
+            return m_size == 0;
+        }
+
+        // Return the UTF-8 encoded argument at the specified index.
+        std::string_view at(qsizetype i) const
+        {
+            return m_data[i];
+        }
+
+        std::string_view operator[](qsizetype i) const
+        {
+            return m_data[i];
+        }
+
+        const std::string_view* begin() const
+        {
+            return m_data;
+        }
+
+        const std::string_view* end() const
+        {
+            return m_data + m_size;
+        }
+
+        // Return the argument at the specified index as a QString.
+        QString toString(qsizetype i) const
+        {
+            return QString::fromUtf8(m_data[i].data(), qsizetype(m_data[i].size()));
+        }
+
+        // Return all the arguments as a list of QString.
+        QList<QString> toList() const
+        {
+            QList<QString> list;
+            list.reserve(m_size);
+
+            for (qsizetype i = 0; i < m_size; ++i) {
+                list.append(toString(i));
+            }
+
+            return list;
+        }
+
+        // Return all the arguments joined with the specified separator.
+        QString join(const QString& separator) const
+        {
+            return toList().join(separator);
+        }
+
+    private:
+        const std::string_view* m_data = nullptr;
+        qsizetype               m_size = 0;
+    };
+
     // Context represents a command execution environment.
     struct Context
     {
         // The arguments used to invoke the command.
-        const QList<QString> arguments;
+        const Arguments arguments;
+
+        // The stream the command should write its output to. The output of asynchronous commands
+        // is buffered and printed in one piece when the command is finished.
+        QTextStream* output = nullptr;
+
+        // The console the command was invoked from. Commands shared by several consoles should use
+        // it rather than the console they were added to.
+        QConsole* console = nullptr;
+
+        // The output of the previous command when the command is part of a pipeline (ex. "help |
+        // grep history"), or null. Reading blocks until the previous command writes more output,
+        // and "atEnd" is true once it returned.
+        QIODevice* input = nullptr;
+    };
+
+    // CompletionRequest describes the argument to be completed by the completion provider of a
+    // command. Providers are run on a worker thread and should return early once the request is
+    // canceled, which happens when the user keeps typing.
+    class CompletionRequest
+    {
+    public:
+        CompletionRequest(const QList<QString>& arguments, const QString& prefix, int timeout)
+          : m_arguments(arguments)
+          , m_prefix(prefix)
+          , m_deadline(timeout)
+        {
+        }
+
+        // Return the arguments preceding the argument to be completed.
+        const QList<QString>& arguments() const
+        {
+            return m_arguments;
+        }
+
+        // Return the position of the argument to be completed.
+        qsizetype position() const
+        {
+            return m_arguments.size();
+        }
+
+        // Return the beginning of the argument to be completed.
+        const QString& prefix() const
+        {
+            return m_prefix;
+        }
+
+        // Return the deadline of the request. Results returned after the deadline are only offered
+        // the next time the user asks for completions.
+        QDeadlineTimer deadline() const
+        {
+            return m_deadline;
+        }
+
+        // Check if the request has been canceled.
+        bool isCanceled() const
+        {
+            return m_canceled.load(std::memory_order_relaxed);
+        }
+
+        // Cancel the request.
+        void cancel()
+        {
+            m_canceled.store(true, std::memory_order_relaxed);
+        }
+
+    private:
+        QList<QString>    m_arguments;
+        QString           m_prefix;
+        QDeadlineTimer    m_deadline;
+        std::atomic<bool> m_canceled{ false };
     };
 
     // Command represents an invokable object.
     struct Command
     {
-        typedef std::function<void(const Context& ctx)> Callback;
+        typedef std::function<void(const Context& ctx)>                         Callback;
+        typedef std::function<QFuture<void>(const Context& ctx)>                AsyncCallback;
+        typedef std::function<QList<QString>(const CompletionRequest& request)> CompletionCallback;
 
         // The name of the command.
         QString name;
@@ -72,21 +251,83 @@ public:
 
         // The callback to be run when the command is invoked.
         Callback invoke;
+
+        // The thread pool used to run "invoke". If set, the command is run asynchronously and the
+        // prompt is shown again right away.
+        QThreadPool* threadPool = nullptr;
+
+        // The callback to be run instead of "invoke" for commands that are asynchronous by nature
+        // (ex. network requests). The command is finished when the returned future is finished and
+        // the context remains valid until then.
+        AsyncCallback invokeAsync;
+
+        // The callback to be run on a worker thread to complete the arguments of the command (ex.
+        // file paths or identifiers fetched from a server). It may be slow: the results are cached
+        // until the next line is evaluated and the prompt doesn't wait for them past a time budget.
+        CompletionCallback complete;
+
+        // Whether "invoke" uses the state of the console (ex. the terminal or the history). When the
+        // command is run by a background job, it's then invoked on the console thread and the job
+        // waits for it.
+        bool consoleThread = false;
+    };
+
+    // CommandSource provides top-level commands on demand instead of registering them up front (ex.
+    // the executables found under $PATH). Sources are only asked about the names no registered
+    // command knows when a line is evaluated or completed, not by the hints and the highlighter,
+    // and their answers are cached until "refreshCommandSources" is called or one of the watched
+    // paths changes. The callbacks may be called from the reader thread.
+    struct CommandSource
+    {
+        typedef std::function<std::optional<Command>(const QString& name)> FindCallback;
+        typedef std::function<QList<QString>(const QString& prefix)>       CompleteCallback;
+
+        // Return the command with the specified name, if the source provides one.
+        FindCallback find;
+
+        // Return the names of the commands starting with the specified prefix.
+        CompleteCallback complete;
+
+        // The files and directories whose changes invalidate the answers of the source.
+        QList<QString> paths;
+    };
+
+    // CommandStatistics summarizes the invocations of a command. The latencies are in nanoseconds
+    // and measure asynchronous commands until their future is finished. The percentiles are
+    // accurate to 1/16 of their value.
+    struct CommandStatistics
+    {
+        QString name;
+        quint64 invocations = 0;
+        quint64 errors      = 0;
+        qint64  p50         = 0;
+        qint64  p99         = 0;
+        qint64  max         = 0;
     };
 
+    // Registry holds commands that can be shared by several consoles.
+    class Registry;
+
     // Return a formatted string with the specified color and style.
     static inline QString colorize(const QString& str, const Color& color, const Style& style = Style::Bold)
     {
         return QStringLiteral("\33[%1;3%2m%3\33[0m").arg(static_cast<int>(style)).arg(static_cast<int>(color)).arg(str);
     }
 
-    // Construct a new QConsole object. Note that you shouldn't create multiple instances of this
-    // class since that would result in unexpected behavior.
+    // Construct a new QConsole object with its own commands.
     explicit QConsole(QObject* parent = nullptr);
 
-    // Destroy the QConsole object.
+    // Construct a new QConsole object sharing the commands of the registry (ex. "QConsole
+    // b(a.registry())"). The consoles only own their terminal, prompt, and history, so this doesn't
+    // copy the commands. Note that only one console should read user input from stdin at a time.
+    explicit QConsole(const std::shared_ptr<Registry>& registry, QObject* parent = nullptr);
+
+    // Destroy the QConsole object. The commands are destroyed with the last console using them.
     ~QConsole();
 
+    // Return the registry holding the commands of the console.
+    std::shared_ptr<Registry> registry();
+
     // Enable reading user input. This isn't a blocking method because the console will
     // be activated after the main loop has been started.
     void start();
@@ -97,15 +338,74 @@ public:
     // Check if the console is currently reading user input.
     bool running();
 
-    // Add a new command to the list of available commands.
+    // Set the input mode. This must be called before "start".
+    void setInputMode(InputMode mode);
+
+    // Get the input mode.
+    InputMode inputMode();
+
+    // Accept console sessions on a local socket (a Unix domain socket, or a named pipe on Windows)
+    // so that operators can attach to the running process (ex. "socat - UNIX-CONNECT:<path>"). A
+    // relative name is placed in the temporary directory, and the socket is only accessible to the
+    // current user. Each session has its own prompt and output, but shares the commands. Returns
+    // false if the socket couldn't be created.
+    bool listen(const QString& name);
+
+    // Accept console sessions on a TCP port bound to localhost. Unlike the local socket, the port is
+    // reachable by every account of the machine, which can then invoke the commands. If a token is
+    // specified, the clients must send it as their first line before they get a prompt, and they're
+    // disconnected otherwise; without one, the sessions are unauthenticated.
+    bool listen(quint16 port, const QString& token = QString());
+
+    // Stop accepting sessions and close the open ones.
+    void stopListening();
+
+    // Add a new command to the list of available commands. A name made of several words (ex.
+    // "cluster node drain") adds a subcommand, creating the intermediate groups as needed. A
+    // command without a callback only sets the description of a group.
     void addCommand(const Command& command);
+    void addCommand(Command&& command);
 
-    // Remove a command using its name.
+    // Add several commands at once. The commands are moved into the console and become visible to
+    // the completion, hint, and highlighter callbacks at the same time. This is much faster than
+    // adding them one by one when registering thousands of commands.
+    void addCommands(std::vector<Command> commands);
+
+    // Add a source of commands that are looked up when they are first used. The commands of the
+    // sources are not listed by "help" or counted by "commandCount".
+    void addCommandSource(const CommandSource& source);
+
+    // Drop what the command sources answered so far.
+    void refreshCommandSources();
+
+    // Remove a command using its name. Groups without any command left are removed too.
     void removeCommandByName(const QString& name);
 
+    // Build a perfect hash table over the current command names to speed up command lookups. This
+    // is meant for command sets that are registered once at startup; the table is rebuilt
+    // transparently before the next lookup if commands are added or removed.
+    void freezeCommands();
+
+    // Stop using the perfect hash table for command lookups.
+    void unfreezeCommands();
+
     // Return the number of commands currently available.
     size_t commandCount();
 
+    // Return the statistics of the commands invoked so far, sorted by name. Commands that throw an
+    // exception (or whose future is canceled or throws) count as errors. Returns an empty list if
+    // the library was built without QCONSOLE_STATISTICS.
+    QList<CommandStatistics> commandStatistics();
+
+    // Forget the invocations recorded so far.
+    void resetCommandStatistics();
+
+    // Evaluate every line read from the device without the line editor. The lines are not added
+    // to the history. A line waiting for asynchronous commands or jobs (ex. "fetch && parse")
+    // holds the rest of the script back until it's evaluated, while the event loop runs, so the
+    // device should stay open until then. Returns the number of lines evaluated before returning.
+    qint64 runScript(QIODevice* device);
+
     // Invoke a command using its name with the specified context. This method returns false
     // if the command wasn't found in the list of available commands.
     bool invokeCommandByName(const QString& name, const Context& ctx = Context{});
@@ -119,10 +419,14 @@ public:
     // Set the current prompt value.
     void setPrompt(const QString& prompt);
 
-    // Set the path to the history file.
+    // Set the path to the history file. Lines are appended to the file as they are evaluated, so the
+    // history survives crashes. History files written by previous versions are converted.
     void setHistoryFilePath(const QString& path);
 
-    // Add the default commands: "help", "version", "exit", "history", and "clear".
+    // Add the default commands: "help", "version", "exit", "history", and "clear". The "help"
+    // command accepts the name of a group to only print its subcommands. The "jobs", "wait", and
+    // "kill" commands manage the commands run in the background with "&", and "more" pages the
+    // output piped into it.
     void addDefaultCommands();
 
     // Set to false to hide user input in the terminal.
@@ -137,6 +441,12 @@ public:
     // Get the path to the history file.
     const QString historyFilePath();
 
+    // Print text without tearing the prompt. This method is thread-safe: the text is pushed onto a
+    // lock-free queue that the console thread drains in batches. While the console thread is blocked
+    // reading a line in the blocking input mode, the text is handed to the line editor instead, which
+    // prints it above the prompt right away.
+    void print(const QString& text);
+
     // Read a line from stdin and return it as a byte array.
     QByteArray readLine(const QString& prompt);
 
@@ -147,15 +457,55 @@ public:
     // faster and more idiomatic access to stdout.
     QTextStream& ostream();
 
+    // Write the output of "producer" through the pager when the command writes to the terminal the
+    // user is typing in: the output is shown one page at a time and only produced as the pages are
+    // shown. The producer then runs on a worker thread and should return once the status of its
+    // stream isn't QTextStream::Ok, which happens when the user quits the pager. Otherwise (ex. when
+    // the command is piped), the producer writes to the output of the context directly.
+    void page(const Context& ctx, const std::function<void(QTextStream& out)>& producer);
+
+    // Set to false to write the output of "page" without the pager.
+    void setPaging(bool enable);
+
     // Set the maximum number of saved history items.
     void setMaxHistorySize(int size);
 
+    // Return the history items containing the pattern, or matching it as a regular expression,
+    // oldest first. The history is indexed by trigrams so that searches don't scan every item.
+    QList<QString> searchHistory(const QString& pattern, bool regex = false);
+
+    // Add an item to the history as if the line had been evaluated: it's appended to the history
+    // file by the background writer.
+    void addHistoryItem(const QString& item);
+
+    // Set to true to share the history file with other processes. The lines evaluated by the other
+    // sessions are added to the history before the next prompt. Call before "setHistoryFilePath".
+    void setSharedHistory(bool shared);
+
     // Set the word break characters.
     void setWordBreakCharacters(const char* characters);
 
     // Set the maximum number of completions to show before paginating.
     void setCompletionCountCutoff(int cutoff);
 
+    // Set to true to complete the names containing the typed characters in order (ex. "hst" completes
+    // "history") instead of the names starting with them. At most "count" completions are offered,
+    // best match first: matches at the start of words and consecutive matches rank higher.
+    void setFuzzyCompletion(bool enable, int count = 64);
+
+    // Return the completions offered for the specified input, in the order they are offered.
+    QList<QString> complete(const QString& input);
+
+    // Return the hint shown for the specified input, or an empty string if there is none.
+    QString hint(const QString& input);
+
+    // Return the input colored the way the line editor highlights it.
+    QString highlight(const QString& input);
+
+    // Set the time budget of the argument completion providers in milliseconds. When a provider
+    // takes longer, no completion is offered and its results are offered on the next attempt.
+    void setArgumentCompletionTimeout(int msecs);
+
     // Set to true if auto-complete should require two tab presses.
     void setDoubleTabCompletion(bool complete);
 
@@ -184,20 +534,145 @@ private:
 private:
     class Terminal;
     class Trie;
-
-    Trie*     m_commands;
-    Terminal* m_terminal;
+    class Reader;
+    class OutputQueue;
+    class Tokenizer;
+    class PerfectHash;
+    class FuzzyIndex;
+    struct CompletionCache;
+    struct PendingCompletion;
+    class Highlighter;
+    class HistoryStore;
+    class HistoryIndex;
+    class Server;
+    struct Session;
+    class Pipe;
+    struct SourceCache;
+    struct Snapshot;
+    struct Node;
+    struct Invocation;
+    struct Statistics;
+    struct Operator;
+    struct Job;
+    struct Suspension;
+    class Pager;
+
+    // The commands, which may be shared with other consoles.
+    std::shared_ptr<Registry> m_registry;
+
+    Terminal*        m_terminal;
+    Reader*          m_reader;
+    OutputQueue*     m_output;
+    CompletionCache* m_completionCache;
+    Highlighter*     m_highlighter;
+    HistoryStore*    m_history;
+    HistoryIndex*    m_historyIndex;
+    Server*          m_server;
+
+    // The session evaluating a line, if any. The prompt methods apply to it instead of the terminal.
+    Session* m_session;
+
+    // One tokenizer per nesting level since commands may evaluate lines themselves. The tokenizers
+    // are reused so that evaluating a line doesn't allocate.
+    QList<Tokenizer*> m_tokenizers;
+    qsizetype         m_depth;
+
+    // Guards the completion cache and the argument completions, which are used by the reader thread
+    // too.
+    QMutex m_completionLock;
+
+    // The argument completion providers run on their own threads, so that a slow provider never
+    // stalls the prompt. The results are cached by command, argument position, and prefix.
+    QThreadPool*                       m_completionPool;
+    std::shared_ptr<PendingCompletion> m_pendingCompletion;
+    QHash<QString, QList<QString>>     m_argumentCompletions;
+    int                                m_argumentCompletionTimeout;
+
+    // The background jobs run on their own bounded thread pool, so that a long job doesn't delay the
+    // argument completions. Finished jobs are kept until they're listed or waited for.
+    QThreadPool*                      m_jobPool;
+    QMutex                            m_jobsLock;
+    std::vector<std::shared_ptr<Job>> m_jobs;
+    int                               m_lastJobID;
+
+    // The producers of the pager run on a single thread, which is kept for the next page.
+    QThreadPool* m_pagerPool;
+
+    // The number of asynchronous commands that aren't finished, and whether the console quits once
+    // they are (at the end of the input in the batch mode).
+    int  m_asyncCommands;
+    bool m_quitWhenIdle;
+
+    // The futures the line being evaluated waits for before going on (ex. "fetch && parse"), and the
+    // number of lines waiting for them. The console thread keeps processing events in the meantime.
+    std::vector<QFuture<void>> m_awaited;
+    int                        m_suspensions;
 
     std::string m_historyFilePath;
     std::string m_defaultPrompt;
     std::string m_prompt;
-
-    bool m_echo;
-    int  m_timerID;
-    bool m_running;
+    int         m_maxHistorySize;
+
+    bool      m_echo;
+    bool      m_paging;
+    bool      m_sharedHistory;
+    bool      m_fuzzyCompletion;
+    int       m_fuzzyCompletionCount;
+    int       m_timerID;
+    bool      m_running;
+    bool      m_terminalOutput;
+    InputMode m_inputMode;
+
+    // Set while the console thread is blocked reading a line in the blocking input mode. The drain
+    // lock serializes the threads draining the output queue.
+    std::atomic<bool> m_reading;
+    QMutex            m_drainLock;
 
     QTextStream m_ostream;
 
-    const Command* findCommandByName(std::string_view name);
-    void           evaluateLine(const char* line);
+    const Node* findChild(const Snapshot& snapshot, const Node& node, std::string_view name, bool resolve);
+    const Node* findSourceCommand(const Snapshot& snapshot, std::string_view name, bool resolve);
+    bool        isSourceAnswered(const Snapshot& snapshot, std::string_view name);
+    std::shared_ptr<const std::vector<CommandSource>> sourceList();
+    const Node* findNode(const Snapshot& snapshot, std::string_view path);
+    const Node* findCompletionNode(const Snapshot& snapshot, std::string_view input, std::string_view& prefix,
+                                   std::string_view& arguments, bool resolve);
+    const Node* findCommandByName(const Snapshot& snapshot, std::string_view name);
+    void        insertCommand(Command&& command, std::string_view name);
+    void        insertCommands(Node* node, std::pair<QByteArray, Command*>* begin, std::pair<QByteArray, Command*>* end,
+                               size_t offset);
+    void        assignCommand(Node& node, Command&& command);
+    void        refreezeCommands();
+    bool        invokePipeline(const std::vector<std::pair<const Node*, Arguments>>& stages, QTextStream& out);
+    bool        invokeJobCommand(const Node& node, const Arguments& arguments, QTextStream& out, Job& job);
+    bool        runList(const std::string_view* tokens, size_t begin, size_t end, const Operator* operators,
+                        size_t count, QTextStream& out, bool last, Job* job, size_t* pending = nullptr);
+    std::optional<size_t> runLists(const std::string_view* tokens, size_t size, const Operator* operators,
+                                   size_t count, QTextStream& out);
+    bool        runPipeline(Arguments tokens, const std::vector<size_t>& pipes, QTextStream& out, bool wait, Job* job);
+    void        startJob(const std::string_view* tokens, size_t begin, size_t end, const Operator* operators,
+                         size_t count, QTextStream& out);
+    void        awaitLine(const std::shared_ptr<Suspension>& suspension);
+    void        resumeLine(const std::shared_ptr<Suspension>& suspension);
+    bool        isPaged(const QTextStream& out);
+    void        drainOutput();
+    void        quitWhenIdle();
+    qint64      runScript(const QPointer<QIODevice>& device, QByteArray input);
+
+    std::shared_ptr<Suspension> evaluateLine(std::string_view line, bool addToHistory = true,
+                                             QTextStream* output = nullptr);
+
+    std::optional<QFuture<void>> invokeCommand(const Node& node, const Context& ctx);
+    void        readNextLine();
+    void        mergeHistory();
+    void        appendHistory(std::string&& text);
+    bool        findHint(std::string_view input, std::string& hint, int& length);
+
+    std::vector<std::string> findCompletions(std::string_view input, std::string_view& prefix, bool fuzzy, bool wait,
+                                             size_t limit = std::numeric_limits<size_t>::max());
+    std::vector<std::string> findArgumentCompletions(const Command& command, std::string_view arguments,
+                                                     std::string_view prefix, bool wait, size_t limit);
+    QList<QString>           findSourceCompletions(const Snapshot& snapshot, std::string_view prefix, bool resolve);
+    void findNameCompletions(const Snapshot& snapshot, const Node& node, std::string_view prefix, bool fuzzy,
+                             size_t limit, std::vector<std::string>& completions);
 };
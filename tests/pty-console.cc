@@ -0,0 +1,75 @@
+// Copyright (c) 2022 Kaiyan M. Lee
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// The console application that the pseudo-terminal tests run and type into.
+
+#include <QConsole>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+
+    QConsole console;
+    console.addDefaultCommands();
+    console.setDefaultPrompt("> ");
+
+    std::vector<QConsole::Command> commands;
+
+    for (int i = 0; i < 10000; ++i) {
+        commands.push_back({
+          QStringLiteral("command-%1").arg(i),
+          "Random description...",
+          [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+        });
+    }
+
+    console.addCommands(std::move(commands));
+
+    // Print from another thread once the prompt is waiting for the next line.
+    console.addCommand({
+      "tick",
+      "Random description...",
+      [](const QConsole::Context& ctx) {
+          QThreadPool::globalInstance()->start([console = ctx.console]() {
+              QThread::msleep(200);
+              console->print(QStringLiteral("tick from a thread\n"));
+          });
+      },
+    });
+
+    console.addCommand({
+      "later",
+      "Random description...",
+      [](const QConsole::Context& ctx) {
+          QThread::msleep(200);
+          *ctx.output << "> later\n";
+      },
+      QThreadPool::globalInstance(),
+    });
+    console.start();
+
+    return app.exec();
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2022 Kaiyan M. Lee
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+#include "test-allocations.h"
+
+#include <QConsole>
+#include <QtTest/QtTest>
+#include <cstddef>
+
+namespace {
+// Count the allocations made by the current thread.
+thread_local bool   countAllocations = false;
+thread_local qint64 allocations      = 0;
+} // namespace
+
+#ifdef __GLIBC__
+// The allocator functions of the C library are interposed so that the allocations of the Qt
+// containers are counted too, and not only those made through operator new (which calls malloc).
+// Aligned allocations aren't counted.
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* p, size_t size);
+
+void* malloc(size_t size) noexcept
+{
+    allocations += countAllocations;
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) noexcept
+{
+    allocations += countAllocations;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) noexcept
+{
+    allocations += countAllocations;
+    return __libc_realloc(p, size);
+}
+}
+#endif
+
+void QConsoleAllocationTester::evaluateTest()
+{
+#ifndef __GLIBC__
+    QSKIP("Allocations are only counted with the GNU C library.");
+#else
+    QConsole console;
+
+    console.addCommand({
+      "command",
+      "Random description...",
+      [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+    });
+
+    const auto script = [](QTemporaryFile& file, int lines) {
+        QVERIFY(file.open());
+
+        for (int i = 0; i < lines; ++i) {
+            file.write("command \"quoted argument\" 'single quoted' escaped\\ argument 12345\n");
+        }
+    };
+
+    QTemporaryFile small;
+    QTemporaryFile large;
+
+    script(small, 1000);
+    script(large, 100000);
+
+    const auto run = [&console](QTemporaryFile& file) {
+        file.seek(0);
+
+        allocations      = 0;
+        countAllocations = true;
+        console.runScript(&file);
+        countAllocations = false;
+
+        return allocations;
+    };
+
+    // Warm up the reused buffers, then check that the number of allocations doesn't depend on the
+    // number of evaluated lines.
+    run(small);
+
+    QCOMPARE(run(large), run(small));
+#endif
+}
+
+QTEST_MAIN(QConsoleAllocationTester);
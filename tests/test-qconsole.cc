@@ -24,7 +24,180 @@
 #include "test-qconsole.h"
 
 #include <QConsole>
+#include <QtNetwork/QLocalSocket>
+#include <QtNetwork/QTcpSocket>
 #include <QtTest/QtTest>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+
+#ifdef QCONSOLE_PTY_CONSOLE
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef Q_OS_MACOS
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+#endif
+
+namespace {
+#ifdef QCONSOLE_PTY_CONSOLE
+// PtyHarness runs a program under a pseudo-terminal, types into it, and measures how long the
+// output takes to settle after each keystroke.
+class PtyHarness
+{
+public:
+    struct Keystroke
+    {
+        // The time between the keystroke and the last byte written before the output settled.
+        qint64 latency = 0;
+
+        // The number of bytes written in response to the keystroke.
+        qint64 bytes = 0;
+    };
+
+    ~PtyHarness()
+    {
+        stop(0);
+    }
+
+    bool start(const char* program)
+    {
+        auto environment = QProcessEnvironment::systemEnvironment();
+        environment.insert("TERM", "xterm");
+
+        // Everything is prepared before forking since the child may only call exec.
+        QList<QByteArray>  variables;
+        std::vector<char*> envp;
+
+        for (const auto& variable : environment.toStringList()) {
+            variables.append(variable.toLocal8Bit());
+        }
+
+        for (auto& variable : variables) {
+            envp.push_back(variable.data());
+        }
+
+        envp.push_back(nullptr);
+
+        char*   argv[] = { const_cast<char*>(program), nullptr };
+        winsize size   = { 24, 80, 0, 0 };
+
+        m_pid = forkpty(&m_fd, nullptr, nullptr, &size);
+
+        if (m_pid == 0) {
+            execve(program, argv, envp.data());
+            _exit(127);
+        }
+
+        return m_pid > 0;
+    }
+
+    // Read the output until it contains the text.
+    bool waitFor(const QByteArray& text, int timeout)
+    {
+        QDeadlineTimer deadline(timeout);
+
+        while (!m_output.contains(text)) {
+            if (deadline.hasExpired() || read(int(deadline.remainingTime())) < 0) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Return everything the program wrote so far.
+    const QByteArray& output() const
+    {
+        return m_output;
+    }
+
+    // Send the keys and read the output until nothing is written for "quiet" milliseconds.
+    Keystroke type(const QByteArray& keys, int quiet)
+    {
+        Keystroke     keystroke;
+        QElapsedTimer timer;
+
+        timer.start();
+
+        if (::write(m_fd, keys.constData(), size_t(keys.size())) != keys.size()) {
+            return keystroke;
+        }
+
+        for (qint64 n = 0; (n = read(quiet)) > 0;) {
+            keystroke.bytes += n;
+            keystroke.latency = timer.nsecsElapsed();
+        }
+
+        return keystroke;
+    }
+
+    // Wait for the program to exit and return its exit code. The program is killed after the
+    // timeout.
+    int stop(int timeout)
+    {
+        if (m_pid <= 0) {
+            return -1;
+        }
+
+        QDeadlineTimer deadline(timeout);
+        int            status = 0;
+
+        while (waitpid(m_pid, &status, WNOHANG) == 0) {
+            if (deadline.hasExpired()) {
+                kill(m_pid, SIGKILL);
+                waitpid(m_pid, &status, 0);
+                break;
+            }
+
+            // Keep reading so that the program doesn't block on a full terminal.
+            read(10);
+        }
+
+        close(m_fd);
+        m_pid = -1;
+
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+
+private:
+    // Read what is available within the timeout. Returns 0 on timeout and -1 at the end.
+    qint64 read(int timeout)
+    {
+        pollfd fd = { m_fd, POLLIN, 0 };
+
+        if (poll(&fd, 1, timeout) <= 0) {
+            return 0;
+        }
+
+        char       buffer[4096];
+        const auto n = ::read(m_fd, buffer, sizeof(buffer));
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        m_output.append(buffer, n);
+
+        // Answer cursor position requests as a terminal would.
+        if (QByteArray::fromRawData(buffer, n).contains("\33[6n") && ::write(m_fd, "\33[1;1R", 6) != 6) {
+            return -1;
+        }
+
+        return n;
+    }
+
+    pid_t      m_pid = -1;
+    int        m_fd  = -1;
+    QByteArray m_output;
+};
+#endif
+} // namespace
 
 void QConsoleTester::populateTest()
 {
@@ -40,6 +213,27 @@ void QConsoleTester::populateTest()
 
     QVERIFY(console.commandCount() == 100);
 
+    std::vector<QConsole::Command> commands;
+
+    for (int i = 100; i < 200; ++i) {
+        commands.push_back({
+          QStringLiteral(" group  %1 ").arg(i),
+          "Random description...",
+          [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+        });
+    }
+
+    console.addCommands(std::move(commands));
+
+    QVERIFY(console.commandCount() == 200);
+    QVERIFY(console.invokeCommandByName("group 150"));
+
+    for (int i = 100; i < 200; ++i) {
+        console.removeCommandByName(QStringLiteral("group %1").arg(i));
+    }
+
+    QVERIFY(console.commandCount() == 100);
+
     for (int i = 0; i < 100; ++i) {
         console.removeCommandByName(QString::number(i));
     }
@@ -47,23 +241,67 @@ void QConsoleTester::populateTest()
     QVERIFY(console.commandCount() == 0);
 }
 
+void QConsoleTester::populateBenchmark_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<QString>("mode");
+
+    // qconsole-bench measures the larger command counts.
+    QTest::addRow("churn") << 10000 << "churn";
+    QTest::addRow("single") << 10000 << "single";
+    QTest::addRow("bulk") << 10000 << "bulk";
+}
+
 void QConsoleTester::populateBenchmark()
 {
+    QFETCH(int, count);
+    QFETCH(QString, mode);
+
     QConsole console;
 
-    QBENCHMARK
-    {
-        for (int i = 0; i < 10000; ++i) {
-            auto name = QString::number(i);
-            console.addCommand({
-              name,
-              "Random description...",
-              [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
-            });
+    // Add and remove each command in turn, which detaches the nodes and invalidates their tables.
+    if (mode == "churn") {
+        QBENCHMARK
+        {
+            for (int i = 0; i < count; ++i) {
+                auto name = QString::number(i);
+                console.addCommand({
+                  name,
+                  "Random description...",
+                  [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+                });
+
+                console.removeCommandByName(name);
+            }
+        }
+
+        QVERIFY(console.commandCount() == 0);
+        return;
+    }
+
+    std::vector<QConsole::Command> commands;
+    commands.reserve(count);
+
+    for (int i = 0; i < count; ++i) {
+        commands.push_back({
+          QString::number(i),
+          "Random description...",
+          [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+        });
+    }
 
-            console.removeCommandByName(name);
+    QBENCHMARK_ONCE
+    {
+        if (mode == "bulk") {
+            console.addCommands(std::move(commands));
+        } else {
+            for (const auto& command : commands) {
+                console.addCommand(command);
+            }
         }
     }
+
+    QVERIFY(console.commandCount() == size_t(count));
 }
 
 void QConsoleTester::colorizeTest()
@@ -111,8 +349,22 @@ void QConsoleTester::unicodeTest()
     QVERIFY(check == false);
 }
 
+void QConsoleTester::evaluateBenchmark_data()
+{
+    QTest::addColumn<int>("count");
+    QTest::addColumn<bool>("frozen");
+
+    for (const auto count : { 10, 1000, 100000 }) {
+        QTest::addRow("trie-%d", count) << count << false;
+        QTest::addRow("frozen-%d", count) << count << true;
+    }
+}
+
 void QConsoleTester::evaluateBenchmark()
 {
+    QFETCH(int, count);
+    QFETCH(bool, frozen);
+
     QConsole console;
 
     QBuffer buffer;
@@ -120,7 +372,7 @@ void QConsoleTester::evaluateBenchmark()
 
     console.setOutputDevice(&buffer);
 
-    for (int i = 0; i < 1000; ++i) {
+    for (int i = 0; i < count; ++i) {
         console.addCommand({
           QString::number(i),
           "Random description...",
@@ -139,6 +391,10 @@ void QConsoleTester::evaluateBenchmark()
       },
     });
 
+    if (frozen) {
+        console.freezeCommands();
+    }
+
     QBENCHMARK
     {
         for (int i = 0; i < 10000; ++i) {
@@ -148,6 +404,1572 @@ void QConsoleTester::evaluateBenchmark()
     }
 }
 
+void QConsoleTester::scriptTest()
+{
+    QConsole console;
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    QList<QString> arguments;
+
+    console.addCommand({
+      "echo",
+      "Random description...",
+      [&arguments](const QConsole::Context& ctx) { arguments.append(ctx.arguments.join(" ")); },
+    });
+
+    const QByteArray script = "echo 1\r\n\n  echo 2 3\nmissing\necho 4";
+
+    QBuffer buffer;
+    buffer.setData(script);
+    buffer.open(QBuffer::ReadOnly);
+
+    QVERIFY(console.runScript(&buffer) == 5);
+    QVERIFY(arguments == QList<QString>({ "1", "2 3", "4" }));
+    QVERIFY(output.data().contains("Command not found: missing"));
+
+    arguments.clear();
+
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.write(script);
+    file.seek(0);
+
+    QVERIFY(console.runScript(&file) == 5);
+    QVERIFY(arguments == QList<QString>({ "1", "2 3", "4" }));
+}
+
+void QConsoleTester::batchTest()
+{
+#ifndef QCONSOLE_PTY_CONSOLE
+    QSKIP("The console application is only built on Unix.");
+#else
+    // Without a terminal, the console evaluates stdin and quits at the end of it, once the
+    // asynchronous command ending the script is finished.
+    QProcess process;
+    process.start(QCONSOLE_PTY_CONSOLE, QStringList());
+
+    QVERIFY(process.waitForStarted(10000));
+
+    process.write("version\nlater\n");
+    process.closeWriteChannel();
+
+    QVERIFY(process.waitForFinished(10000));
+    QVERIFY(process.exitStatus() == QProcess::NormalExit && process.exitCode() == 0);
+    QVERIFY(process.readAllStandardOutput().contains("> later\n"));
+#endif
+}
+
+void QConsoleTester::asyncTest()
+{
+    QConsole console;
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    QThreadPool pool;
+    QSemaphore  started;
+    QSemaphore  release;
+
+    console.addCommand({
+      "echo",
+      "Random description...",
+      [](const QConsole::Context& ctx) { *ctx.output << "> " << ctx.arguments.join(" ") << '\n'; },
+    });
+
+    console.addCommand({
+      "slow",
+      "Random description...",
+      [&started, &release](const QConsole::Context& ctx) {
+          started.release();
+          release.acquire();
+          *ctx.output << "> slow " << ctx.arguments.join(" ") << '\n';
+      },
+      &pool,
+    });
+
+    console.addCommand({
+      "fail",
+      "Random description...",
+      [](const QConsole::Context& ctx) {
+          Q_UNUSED(ctx);
+          throw std::runtime_error("failed");
+      },
+      &pool,
+    });
+
+    QPromise<void> promise;
+    QPromise<void> deferred;
+
+    console.addCommand({
+      "defer",
+      "Random description...",
+      nullptr,
+      nullptr,
+      [&deferred](const QConsole::Context& ctx) {
+          *ctx.output << "> deferred\n";
+
+          deferred.start();
+          return deferred.future();
+      },
+    });
+
+    console.addCommand({
+      "fetch",
+      "Random description...",
+      nullptr,
+      nullptr,
+      [&promise](const QConsole::Context& ctx) {
+          *ctx.output << "> fetched\n";
+
+          promise.start();
+          return promise.future();
+      },
+    });
+
+    const auto run = [&console](const QByteArray& script) {
+        QBuffer buffer;
+        buffer.setData(script);
+        buffer.open(QBuffer::ReadOnly);
+        console.runScript(&buffer);
+    };
+
+    // The prompt is shown again while the command runs on the pool...
+    run("slow a\n");
+
+    QVERIFY(started.tryAcquire(1, 5000));
+    QVERIFY(!output.data().contains("> slow a\n"));
+
+    // ...and its output is printed in one piece once it's finished.
+    release.release();
+
+    QTRY_VERIFY(output.data().contains("> slow a\n"));
+
+    // Exceptions thrown on the pool are reported.
+    run("fail\n");
+
+    QTRY_VERIFY(output.data().contains("Command failed: fail: failed"));
+
+    // The output of the future is printed once it's finished.
+    run("fetch\n");
+
+    QTest::qWait(10);
+    QVERIFY(!output.data().contains("> fetched\n"));
+
+    promise.finish();
+
+    QTRY_VERIFY(output.data().contains("> fetched\n"));
+
+    // The next command of a list waits for the asynchronous command, and only runs if it succeeded.
+    output.buffer().clear();
+    output.seek(0);
+    release.release();
+
+    run("slow b && echo c\nfail && echo d\n");
+
+    QTRY_VERIFY(output.data().contains("> slow b\n> c\n"));
+    QTRY_VERIFY(output.data().contains("Command failed: fail: failed"));
+    QVERIFY(!output.data().contains("> d\n"));
+
+    // The console thread keeps processing events while the rest of the line waits.
+    run("defer && echo e\n");
+
+    QTest::qWait(10);
+    QVERIFY(!output.data().contains("> e\n"));
+
+    deferred.finish();
+
+    QTRY_VERIFY(output.data().contains("> deferred\n> e\n"));
+
+    pool.waitForDone();
+}
+
+void QConsoleTester::printTest()
+{
+    QConsole console;
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    const int threadCount = 8;
+    const int lineCount   = 2000;
+
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < threadCount; ++t) {
+        threads.emplace_back([&console, t]() {
+            for (int i = 0; i < lineCount; ++i) {
+                console.print(QStringLiteral("%1:%2\n").arg(t).arg(i));
+            }
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    QTRY_COMPARE(output.data().count('\n'), qsizetype(threadCount * lineCount));
+
+    // Every line is printed whole, and the lines of a thread are printed in order.
+    std::vector<int> next(threadCount, 0);
+
+    for (const auto& line : output.data().split('\n')) {
+        if (line.isEmpty()) {
+            continue;
+        }
+
+        const auto fields = line.split(':');
+
+        QVERIFY(fields.size() == 2);
+
+        const auto t = fields[0].toInt();
+
+        QVERIFY(t >= 0 && t < threadCount);
+        QVERIFY(fields[1].toInt() == next[size_t(t)]++);
+    }
+
+#ifdef QCONSOLE_PTY_CONSOLE
+    // The text printed while the prompt waits for a line in the blocking input mode shows up right
+    // away.
+    PtyHarness pty;
+
+    QVERIFY(pty.start(QCONSOLE_PTY_CONSOLE));
+    QVERIFY(pty.waitFor("> ", 10000));
+
+    pty.type("tick\r", 50);
+
+    QVERIFY(pty.waitFor("tick from a thread", 5000));
+
+    pty.type("\x04", 50);
+
+    QVERIFY(pty.stop(5000) == 0);
+#endif
+}
+
+void QConsoleTester::scriptBenchmark()
+{
+    QConsole console;
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    qint64 invocations = 0;
+
+    console.addCommand({
+      "command",
+      "Random description...",
+      [&invocations](const QConsole::Context& ctx) {
+          Q_UNUSED(ctx)
+          invocations++;
+      },
+    });
+
+    const qint64 lines = 2000000;
+
+    QByteArray script;
+    script.reserve(lines * 24);
+
+    for (qint64 i = 0; i < lines; ++i) {
+        script.append("command argument ").append(QByteArray::number(i % 1000)).append('\n');
+    }
+
+    QBuffer buffer;
+    buffer.setData(script);
+
+    QElapsedTimer timer;
+
+    QBENCHMARK_ONCE
+    {
+        buffer.open(QBuffer::ReadOnly);
+        timer.start();
+        QVERIFY(console.runScript(&buffer) == lines);
+        qInfo() << "Commands per second:" << qRound64(lines * 1e9 / timer.nsecsElapsed());
+        buffer.close();
+    }
+
+    QVERIFY(invocations == lines);
+}
+
+void QConsoleTester::tokenizeTest()
+{
+    QConsole console;
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    QList<QString> arguments;
+
+    console.addCommand({
+      "echo",
+      "Random description...",
+      [&arguments](const QConsole::Context& ctx) { arguments = ctx.arguments.toList(); },
+    });
+
+    QBuffer buffer;
+    buffer.setData("echo a\"b c\"d 'e\\f' g\\ h \"i\\\"j\" \"\"\n");
+    buffer.open(QBuffer::ReadOnly);
+    console.runScript(&buffer);
+
+    QVERIFY(arguments == QList<QString>({ "ab cd", "e\\f", "g h", "i\"j", "" }));
+
+    buffer.close();
+    buffer.setData("echo \"unterminated\n");
+    buffer.open(QBuffer::ReadOnly);
+    console.runScript(&buffer);
+
+    QVERIFY(output.data().contains("Unterminated quote"));
+}
+
+void QConsoleTester::pipelineTest()
+{
+    QConsole console;
+    console.addDefaultCommands();
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    int produced = 0;
+
+    // Print numbers until the next command stops reading them.
+    console.addCommand({
+      "numbers",
+      "Random description...",
+      [&produced](const QConsole::Context& ctx) {
+          const auto count = ctx.arguments.toString(0).toInt();
+
+          for (produced = 0; produced < count && ctx.output->status() == QTextStream::Ok; ++produced) {
+              *ctx.output << produced << '\n';
+          }
+      },
+    });
+
+    console.addCommand({
+      "count",
+      "Random description...",
+      [](const QConsole::Context& ctx) {
+          qsizetype lines = 0;
+
+          while (ctx.input != nullptr && !ctx.input->atEnd()) {
+              lines += ctx.input->readLine().endsWith('\n');
+          }
+
+          *ctx.output << "lines: " << lines << Qt::endl;
+      },
+    });
+
+    console.addCommand({
+      "first",
+      "Random description...",
+      [](const QConsole::Context& ctx) { *ctx.output << "first: " << ctx.input->readLine(); },
+    });
+
+    QBuffer buffer;
+    buffer.setData("numbers 100000 | count\n"
+                   "numbers 3|grep 2\n"
+                   "numbers 100000000 | first\n");
+    buffer.open(QBuffer::ReadOnly);
+    console.runScript(&buffer);
+
+    // The output is streamed through bounded buffers, so the producer stops once the consumer does.
+    QVERIFY(output.data().contains("lines: 100000\n"));
+    QVERIFY(output.data().contains("2\n"));
+    QVERIFY(!output.data().contains("1\n"));
+    QVERIFY(output.data().contains("first: 0\n"));
+    QVERIFY(produced < 100000000);
+
+    output.buffer().clear();
+    output.seek(0);
+
+    buffer.close();
+    buffer.setData("numbers 1 |\n"
+                   "count \"|\" | unknown\n");
+    buffer.open(QBuffer::ReadOnly);
+    console.runScript(&buffer);
+
+    QVERIFY(output.data().contains("Syntax error"));
+    QVERIFY(output.data().contains("Command not found: unknown"));
+
+    QVERIFY(console.highlight("numbers|count") == "\33[92mnumbers\33[94m|\33[92mcount\33[0m");
+}
+
+void QConsoleTester::jobsTest()
+{
+    QConsole console;
+    console.addDefaultCommands();
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    console.addCommand({
+      "echo",
+      "Random description...",
+      [](const QConsole::Context& ctx) { *ctx.output << "> " << ctx.arguments.join(" ") << '\n'; },
+    });
+
+    console.addCommand({
+      "fail",
+      "Random description...",
+      [](const QConsole::Context& ctx) {
+          Q_UNUSED(ctx);
+          throw std::runtime_error("failed");
+      },
+    });
+
+    // Print until the job is killed.
+    console.addCommand({
+      "spin",
+      "Random description...",
+      [](const QConsole::Context& ctx) {
+          while (ctx.output->status() == QTextStream::Ok) {
+              *ctx.output << '.';
+              ctx.output->flush();
+              QThread::msleep(1);
+          }
+      },
+    });
+
+    QBuffer buffer;
+    buffer.setData("echo a & echo b &\n"
+                   "unknown && echo c ; echo d\n"
+                   "fail && echo e &\n"
+                   "wait\n"
+                   "spin &\n"
+                   "kill 4\n"
+                   "wait 4\n"
+                   "echo \"&\" ';'\n"
+                   "; echo f\n"
+                   "echo g &&\n");
+    buffer.open(QBuffer::ReadOnly);
+    console.runScript(&buffer);
+
+    // The lines following "wait" are evaluated once the jobs are finished.
+    QTRY_VERIFY(output.data().contains("Syntax error near \"&&\""));
+
+    const auto data = output.data();
+
+    QVERIFY(data.contains("[1] echo a\n"));
+    QVERIFY(data.contains("> a\n"));
+    QVERIFY(data.contains("> b\n"));
+    QVERIFY(data.contains("Command not found: unknown"));
+    QVERIFY(!data.contains("> c\n"));
+    QVERIFY(data.contains("> d\n"));
+    QVERIFY(data.contains("Command failed: fail: failed"));
+    QVERIFY(!data.contains("> e\n"));
+    QVERIFY(data.contains("[1] Done    echo a\n"));
+    QVERIFY(data.contains("[3] Failed  fail && echo e\n"));
+    QVERIFY(data.contains("[4] Killed  spin\n"));
+    QVERIFY(data.contains("> & ;\n"));
+    QVERIFY(data.contains("Syntax error near \";\""));
+    QVERIFY(data.contains("Syntax error near \"&&\""));
+    QVERIFY(!data.contains("> f\n"));
+    QVERIFY(!data.contains("> g\n"));
+
+    // The jobs waited for are forgotten.
+    output.buffer().clear();
+    output.seek(0);
+
+    buffer.close();
+    buffer.setData("jobs\n");
+    buffer.open(QBuffer::ReadOnly);
+    console.runScript(&buffer);
+
+    QVERIFY(output.data().isEmpty());
+
+    // The commands using the console state run on the console thread, even in the background.
+    buffer.close();
+    buffer.setData("history &\nhistory | echo &\n");
+    buffer.open(QBuffer::ReadOnly);
+    console.runScript(&buffer);
+
+    QTRY_VERIFY(output.data().contains("[5] Done    history\n"));
+    QTRY_VERIFY(output.data().contains("Command can't be piped: history"));
+
+    // In the foreground, only the last command of a pipeline runs on the console thread.
+    output.buffer().clear();
+    output.seek(0);
+
+    buffer.close();
+    buffer.setData("history | echo\necho a | history\n");
+    buffer.open(QBuffer::ReadOnly);
+    console.runScript(&buffer);
+
+    QVERIFY(output.data().count("Command can't be piped: history") == 1);
+
+    QVERIFY(console.highlight("echo a;echo b") == "\33[92mecho\33[0m a\33[94m;\33[92mecho\33[0m b");
+}
+
+void QConsoleTester::freezeTest()
+{
+    QConsole console;
+
+    int check = 0;
+
+    for (int i = 0; i < 100; ++i) {
+        console.addCommand({
+          QString::number(i),
+          "Random description...",
+          [&check, i](const QConsole::Context& ctx) {
+              Q_UNUSED(ctx)
+              check = i;
+          },
+        });
+    }
+
+    console.freezeCommands();
+
+    QVERIFY(console.invokeCommandByName("42"));
+    QVERIFY(check == 42);
+    QVERIFY(!console.invokeCommandByName("100"));
+
+    // The table is rebuilt transparently when the commands change.
+    console.addCommand({
+      "100",
+      "Random description...",
+      [&check](const QConsole::Context& ctx) {
+          Q_UNUSED(ctx)
+          check = 100;
+      },
+    });
+
+    console.removeCommandByName("42");
+
+    QVERIFY(console.invokeCommandByName("100"));
+    QVERIFY(check == 100);
+    QVERIFY(!console.invokeCommandByName("42"));
+
+    // Only the tables of the groups whose children changed are rebuilt.
+    for (int i = 0; i < 2; ++i) {
+        console.addCommand({
+          QStringLiteral("group %1").arg(200 + i),
+          "Random description...",
+          [&check, i](const QConsole::Context& ctx) {
+              Q_UNUSED(ctx)
+              check = 200 + i;
+          },
+        });
+    }
+
+    QVERIFY(console.invokeCommandByName("group 201"));
+    QVERIFY(check == 201);
+
+    console.removeCommandByName("group 201");
+
+    QVERIFY(!console.invokeCommandByName("group 201"));
+    QVERIFY(console.invokeCommandByName("group 200"));
+    QVERIFY(check == 200);
+    QVERIFY(console.invokeCommandByName("7"));
+    QVERIFY(check == 7);
+
+    console.unfreezeCommands();
+
+    QVERIFY(console.invokeCommandByName("7"));
+    QVERIFY(check == 7);
+}
+
+void QConsoleTester::subcommandTest()
+{
+    QConsole console;
+    console.addDefaultCommands();
+
+    const auto defaults = console.commandCount();
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    QList<QString> drained;
+
+    console.addCommand({ "cluster", "Manage the cluster." });
+
+    console.addCommand({
+      "cluster node drain",
+      "Drain a node.",
+      [&drained](const QConsole::Context& ctx) { drained = ctx.arguments.toList(); },
+    });
+
+    console.addCommand({
+      "cluster node list",
+      "List the nodes.",
+      [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+    });
+
+    QVERIFY(console.commandCount() == defaults + 2);
+
+    QBuffer buffer;
+    buffer.setData("cluster node drain 5 6\nhelp cluster node\n");
+    buffer.open(QBuffer::ReadOnly);
+    console.runScript(&buffer);
+
+    QVERIFY(drained == QList<QString>({ "5", "6" }));
+    QVERIFY(output.data().contains("cluster node drain"));
+    QVERIFY(output.data().contains("cluster node list"));
+    QVERIFY(!output.data().contains("Manage the cluster."));
+    QVERIFY(!output.data().contains("Print help information."));
+
+    QVERIFY(console.invokeCommandByName("cluster node drain"));
+    QVERIFY(drained.isEmpty());
+
+    // Removing the last command of a group removes the group.
+    console.removeCommandByName("cluster node drain");
+    console.removeCommandByName("cluster node list");
+
+    QVERIFY(console.commandCount() == defaults);
+    QVERIFY(!console.invokeCommandByName("cluster node drain"));
+}
+
+void QConsoleTester::fuzzyCompletionTest()
+{
+    QConsole console;
+
+    for (const auto& name : { "history", "help", "shell-history", "hist", "HashSet", "cluster node drain" }) {
+        console.addCommand({
+          name,
+          "Random description...",
+          [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+        });
+    }
+
+    QVERIFY(console.complete("hs") == QList<QString>());
+    QVERIFY(console.complete("hi") == QList<QString>({ "hist", "history" }));
+
+    console.setFuzzyCompletion(true);
+
+    QVERIFY(console.complete("hist") == QList<QString>({ "hist", "history", "shell-history" }));
+    QVERIFY(console.complete("HS").size() == 4);
+    QVERIFY(console.complete("HS").first() == "hist");
+    QVERIFY(console.complete("HS").last() == "shell-history");
+    QVERIFY(console.complete("cluster nd") == QList<QString>({ "node" }));
+    QVERIFY(console.complete("cluster node dn") == QList<QString>({ "drain" }));
+    QVERIFY(console.complete("xyz").isEmpty());
+
+    // The index is rebuilt when the commands change.
+    console.removeCommandByName("hist");
+    console.setFuzzyCompletion(true, 1);
+
+    QVERIFY(console.complete("hist") == QList<QString>({ "history" }));
+}
+
+void QConsoleTester::completionCacheTest()
+{
+    QConsole console;
+
+    for (const auto& name : { "cat", "cargo", "cmake", "cmp", "ctest" }) {
+        console.addCommand({
+          name,
+          "Random description...",
+          [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+        });
+    }
+
+    // Typing narrows the cached candidates, erasing drops them.
+    QVERIFY(console.complete("c").size() == 5);
+    QVERIFY(console.complete("ca") == QList<QString>({ "cargo", "cat" }));
+    QVERIFY(console.complete("car") == QList<QString>({ "cargo" }));
+    QVERIFY(console.complete("c").size() == 5);
+    QVERIFY(console.complete("cm") == QList<QString>({ "cmake", "cmp" }));
+
+    // Adding or removing commands drops them too.
+    console.addCommand({
+      "cmd",
+      "Random description...",
+      [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+    });
+
+    QVERIFY(console.complete("cm") == QList<QString>({ "cmake", "cmd", "cmp" }));
+
+    console.removeCommandByName("cmake");
+
+    QVERIFY(console.complete("cm") == QList<QString>({ "cmd", "cmp" }));
+
+    console.setFuzzyCompletion(true);
+
+    QVERIFY(console.complete("ct") == QList<QString>({ "ctest", "cat" }));
+    QVERIFY(console.complete("cte") == QList<QString>({ "ctest" }));
+    QVERIFY(console.complete("ct") == QList<QString>({ "ctest", "cat" }));
+}
+
+void QConsoleTester::argumentCompletionTest()
+{
+    // The providers may still be running until the console is destroyed.
+    std::atomic<int>  calls    = 0;
+    std::atomic<bool> canceled = false;
+    QSemaphore        release;
+
+    QConsole console;
+
+    console.addCommand({
+      "deploy",
+      "Deploy a service.",
+      [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+      nullptr,
+      nullptr,
+      [&calls](const QConsole::CompletionRequest& request) {
+          QList<QString> list;
+
+          for (const auto& name : { "api", "auth", "billing" }) {
+              if (QString(name).startsWith(request.prefix())) {
+                  list.append(name);
+              }
+          }
+
+          calls++;
+          return list;
+      },
+    });
+
+    console.setArgumentCompletionTimeout(5000);
+
+    QVERIFY(console.complete("deploy a") == QList<QString>({ "api", "auth" }));
+    QVERIFY(console.complete("deploy a") == QList<QString>({ "api", "auth" }));
+    QVERIFY(calls == 1);
+    QVERIFY(console.complete("deploy api b") == QList<QString>({ "billing" }));
+    QVERIFY(calls == 2);
+
+    // A slow provider doesn't stall completion; its results are offered on the next attempt.
+    console.addCommand({
+      "fetch",
+      "Fetch a resource.",
+      [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+      nullptr,
+      nullptr,
+      [&release](const QConsole::CompletionRequest& request) {
+          Q_UNUSED(request)
+          release.acquire();
+          return QList<QString>({ "done" });
+      },
+    });
+
+    console.setArgumentCompletionTimeout(10);
+
+    QVERIFY(console.complete("fetch d").isEmpty());
+    release.release();
+    QTRY_VERIFY(console.complete("fetch d") == QList<QString>({ "done" }));
+
+    // Typing on cancels the stale request.
+    console.addCommand({
+      "scan",
+      "Scan the network.",
+      [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+      nullptr,
+      nullptr,
+      [&canceled](const QConsole::CompletionRequest& request) {
+          while (!request.isCanceled()) {
+              QThread::msleep(1);
+          }
+
+          canceled = true;
+          return QList<QString>();
+      },
+    });
+
+    QVERIFY(console.complete("scan a").isEmpty());
+    QVERIFY(console.complete("scan ab").isEmpty());
+    QTRY_VERIFY(canceled);
+}
+
+void QConsoleTester::commandSourceTest()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    QConsole console;
+
+    int finds   = 0;
+    int invoked = 0;
+
+    console.addCommand({
+      "fetch",
+      "Fetch a resource.",
+      [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+    });
+
+    // A source providing the files of a directory as commands.
+    console.addCommandSource({
+      [&](const QString& name) -> std::optional<QConsole::Command> {
+          finds++;
+
+          if (!QFile::exists(dir.filePath(name))) {
+              return std::nullopt;
+          }
+
+          return QConsole::Command{
+              name,
+              "[file]",
+              [&invoked](const QConsole::Context& ctx) {
+                  Q_UNUSED(ctx)
+                  invoked++;
+              },
+          };
+      },
+      [&](const QString& prefix) { return QDir(dir.path()).entryList({ prefix + '*' }, QDir::Files); },
+      { dir.path() },
+    });
+
+    // Misses are cached too.
+    QVERIFY(!console.invokeCommandByName("tool"));
+    QVERIFY(!console.invokeCommandByName("tool"));
+    QVERIFY(finds == 1);
+
+    QFile file(dir.filePath("tool"));
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.close();
+
+    // The cache is dropped when the directory changes.
+    QTRY_VERIFY(console.invokeCommandByName("tool"));
+    QVERIFY(console.invokeCommandByName("tool"));
+    QVERIFY(invoked == 2);
+
+    QVERIFY(console.complete("t") == QList<QString>({ "tool" }));
+    QVERIFY(console.complete("f") == QList<QString>({ "fetch" }));
+    QVERIFY(console.commandCount() == 1);
+
+    const auto count = finds;
+    console.refreshCommandSources();
+
+    QVERIFY(console.invokeCommandByName("tool"));
+    QVERIFY(finds == count + 1);
+
+    // The sources are only asked when evaluating and completing, not while typing. The names they
+    // weren't asked about yet are not highlighted as unknown.
+    QVERIFY(console.hint("to").isEmpty());
+    QVERIFY(console.highlight("other") == "other");
+    QVERIFY(finds == count + 1);
+
+    QVERIFY(console.complete("to") == QList<QString>({ "tool" }));
+    QVERIFY(console.hint("to") == "tool");
+    QVERIFY(!console.invokeCommandByName("other"));
+    QVERIFY(console.highlight("other") == "\33[31mother\33[0m");
+
+    // The misses are forgotten once there are too many of them.
+    for (int i = 0; i < 1024; ++i) {
+        QVERIFY(!console.invokeCommandByName(QStringLiteral("missing-%1").arg(i)));
+    }
+
+    const auto misses = finds;
+
+    QVERIFY(!console.invokeCommandByName("missing-0"));
+    QVERIFY(finds == misses + 1);
+}
+
+void QConsoleTester::historyJournalTest()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    const auto path = dir.filePath("history.txt");
+
+    const auto history = [&path]() {
+        QConsole console;
+        console.addDefaultCommands();
+        console.setHistoryFilePath(path);
+
+        QBuffer output;
+        output.open(QBuffer::WriteOnly);
+
+        console.setOutputDevice(&output);
+
+        QBuffer script;
+        script.setData("history");
+        script.open(QBuffer::ReadOnly);
+        console.runScript(&script);
+
+        return output.data();
+    };
+
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    file.write("### 2022-01-01 10:00:00.000\necho 1\n### 2022-01-01 10:00:01.000\necho 2\n");
+    file.close();
+
+    // History files written by previous versions are converted to journals.
+    auto output = history();
+    QVERIFY(output.contains("echo 1") && output.contains("echo 2"));
+
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QVERIFY(file.read(8) == "QCHIST2\n");
+
+    // Simulate a crash in the middle of a write.
+    const auto size = file.size();
+    file.seek(size);
+    file.write(QByteArray("\x20\x00\x00\x00" "echo", 8));
+    file.close();
+
+    output = history();
+    QVERIFY(output.contains("echo 1") && output.contains("echo 2"));
+    QVERIFY(QFileInfo(path).size() == size);
+}
+
+void QConsoleTester::historySearchTest()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    QFile file(dir.filePath("history.txt"));
+    QVERIFY(file.open(QIODevice::WriteOnly));
+
+    for (const auto& line : { "cluster node drain 1", "cluster node drain 2", "ping", "cluster node drain 1" }) {
+        file.write(QByteArray("### 2022-01-01 10:00:00.000\n").append(line).append('\n'));
+    }
+
+    file.close();
+
+    QConsole console;
+    console.addDefaultCommands();
+    console.setHistoryFilePath(file.fileName());
+
+    // Duplicates are discarded by default.
+    QVERIFY(console.searchHistory("drain") == QList<QString>({ "cluster node drain 2", "cluster node drain 1" }));
+    QVERIFY(console.searchHistory("in") == QList<QString>({ "cluster node drain 2", "ping", "cluster node drain 1" }));
+    QVERIFY(console.searchHistory("drain 3").isEmpty());
+    QVERIFY(console.searchHistory("^cl.*1$", true) == QList<QString>({ "cluster node drain 1" }));
+    QVERIFY(console.searchHistory("(", true).isEmpty());
+
+    // The options and the escapes of the pattern aren't taken for text the entries must contain.
+    QVERIFY(console.searchHistory("(?i)PING", true) == QList<QString>({ "ping" }));
+    QVERIFY(console.searchHistory("\\x70ing", true) == QList<QString>({ "ping" }));
+    QVERIFY(console.searchHistory("\\160ing", true) == QList<QString>({ "ping" }));
+    QVERIFY(console.searchHistory("drain\\s2", true) == QList<QString>({ "cluster node drain 2" }));
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    QBuffer script;
+    script.setData("history -r 'ping|2'");
+    script.open(QBuffer::ReadOnly);
+    console.runScript(&script);
+
+    QVERIFY(output.data().contains("drain 2") && output.data().contains("ping"));
+    QVERIFY(!output.data().contains("drain 1"));
+
+    // The items added without being evaluated are indexed and journaled too.
+    console.addHistoryItem("  ping again ");
+    QVERIFY(console.searchHistory("again") == QList<QString>({ "ping again" }));
+
+    // Switching to another file commits the queued items.
+    console.setHistoryFilePath(dir.filePath("other.txt"));
+
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    QVERIFY(file.readAll().contains("ping again"));
+}
+
+void QConsoleTester::sharedHistoryTest()
+{
+    QTemporaryDir dir;
+    QVERIFY(dir.isValid());
+
+    QConsole console;
+    console.addDefaultCommands();
+    console.setSharedHistory(true);
+    console.setHistoryFilePath(dir.filePath("history.txt"));
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    // Frame records the way another process sharing the file would.
+    const auto record = [](quint64 sequence, const QByteArray& payload) {
+        QByteArray result;
+
+        const auto append = [&result](auto value) {
+            const auto le = qToLittleEndian(value);
+            result.append(reinterpret_cast<const char*>(&le), sizeof(le));
+        };
+
+        append(quint32(payload.size()));
+        append(quint32(0));
+        append(sequence);
+        result.append(payload);
+        append(quint32(payload.size()));
+
+        quint32 hash = 2166136261u;
+
+        for (auto i = 8; i < result.size() - 4; ++i) {
+            hash = (hash ^ quint8(result[i])) * 16777619u;
+        }
+
+        const auto le = qToLittleEndian(hash);
+        result.replace(4, sizeof(le), reinterpret_cast<const char*>(&le), sizeof(le));
+
+        return result;
+    };
+
+    QFile file(dir.filePath("history.txt"));
+    QVERIFY(file.open(QIODevice::Append));
+    file.write(record(1, "2022-01-01 10:00:00.000\nping old and rather long"));
+    file.write(record(2, "2022-01-01 10:00:01.000\nping remote"));
+    file.close();
+
+    // The entries of other sessions are picked up incrementally.
+    QTRY_VERIFY_WITH_TIMEOUT(
+      [&]() {
+          QBuffer script;
+          script.setData("history remote");
+          script.open(QBuffer::ReadOnly);
+          console.runScript(&script);
+
+          return output.data().contains("ping remote");
+      }(),
+      5000);
+
+    QVERIFY(console.searchHistory("remote") == QList<QString>({ "ping remote" }));
+
+    // Another process compacts the file away from under the console: the entries already read aren't replayed.
+    QSaveFile compacted(dir.filePath("history.txt"));
+    QVERIFY(compacted.open(QIODevice::WriteOnly));
+    compacted.write("QCHIST2\n");
+    compacted.write(record(2, "2022-01-01 10:00:01.000\nping remote"));
+    compacted.write(record(3, "2022-01-01 10:00:02.000\nping third"));
+    QVERIFY(compacted.commit());
+
+    QTRY_VERIFY_WITH_TIMEOUT(
+      [&]() {
+          QBuffer script;
+          script.setData("history third");
+          script.open(QBuffer::ReadOnly);
+          console.runScript(&script);
+
+          return output.data().contains("ping third");
+      }(),
+      5000);
+
+    QVERIFY(console.searchHistory("ping")
+            == QList<QString>({ "ping old and rather long", "ping remote", "ping third" }));
+}
+
+void QConsoleTester::statisticsTest()
+{
+    QConsole console;
+    console.addDefaultCommands();
+
+    console.addCommand({
+      "scan",
+      "Random description...",
+      [](const QConsole::Context& ctx) {
+          if (!ctx.arguments.isEmpty()) {
+              throw std::runtime_error("Scan failed");
+          }
+      },
+    });
+
+    QVERIFY(console.invokeCommandByName("scan"));
+    QVERIFY(console.invokeCommandByName("scan"));
+
+    const std::string_view arguments[] = { "fail" };
+    QVERIFY_EXCEPTION_THROWN(console.invokeCommandByName("scan", { QConsole::Arguments(arguments, 1) }),
+                             std::runtime_error);
+
+    const auto statistics = console.commandStatistics();
+
+    if (statistics.isEmpty()) {
+        QSKIP("The statistics were compiled out.");
+    }
+
+    QVERIFY(statistics.size() == 1 && statistics[0].name == "scan");
+    QVERIFY(statistics[0].invocations == 3 && statistics[0].errors == 1);
+    QVERIFY(statistics[0].p50 <= statistics[0].p99 && statistics[0].p99 <= statistics[0].max);
+
+    QBuffer output;
+    output.open(QBuffer::WriteOnly);
+
+    console.setOutputDevice(&output);
+
+    QBuffer script;
+    script.setData("stats");
+    script.open(QBuffer::ReadOnly);
+    console.runScript(&script);
+
+    QVERIFY(output.data().contains("3 calls, 1 errors"));
+
+    console.resetCommandStatistics();
+    QVERIFY(console.commandStatistics().isEmpty());
+
+    // The statistics are shared by the copies of the node made when the commands change.
+    QVERIFY(console.invokeCommandByName("scan"));
+    console.addCommand({ "scan status", "Random description...", [](const QConsole::Context&) {} });
+    QVERIFY(console.invokeCommandByName("scan"));
+
+    QVERIFY(console.commandStatistics().size() == 1 && console.commandStatistics()[0].invocations == 2);
+}
+
+void QConsoleTester::highlightTest()
+{
+    QConsole console;
+
+    console.addCommand({
+      "ping",
+      "Random description...",
+      [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+    });
+
+    QVERIFY(console.hint("pi") == "ping");
+    QVERIFY(console.hint("ping ").isEmpty());
+
+    QVERIFY(console.highlight("ping 42") == "\33[92mping\33[0m \33[95m42\33[0m");
+    QVERIFY(console.highlight("pong") == "\33[31mpong\33[0m");
+}
+
+void QConsoleTester::highlightEditTest()
+{
+    QConsole console;
+
+    for (const auto& name : {"ping", "group sub", "\u00e9"}) {
+        console.addCommand({
+          name,
+          "Random description...",
+          [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+        });
+    }
+
+    // Each thread has its own highlighter, so a new thread lexes the whole line.
+    const auto highlight = [&console](const QString& line) {
+        QString result;
+        std::thread([&]() { result = console.highlight(line); }).join();
+        return result;
+    };
+
+    // Multi-byte code points sharing their leading bytes make the edits split them.
+    const QStringList pieces = {
+      "ping", "group", "sub", " ", " ", "|", "&", "&&", ";", "\"", "'", "\\", "-f", "42", "x",
+      "\u00e9", "\u00e8", "\u20ac", QString::fromUtf8("\xf0\x9d\x84\x9e"), QString::fromUtf8("\xf0\x9d\x84\xa2"),
+    };
+
+    QRandomGenerator random(42);
+    QStringList      line;
+
+    for (int i = 0; i < 2000; ++i) {
+        const auto at = random.bounded(line.size() + 1);
+
+        if (i == 1000) {
+            console.addCommand({
+              "x",
+              "Random description...",
+              [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+            });
+        }
+
+        if (at < line.size() && random.bounded(3) == 0) {
+            line.remove(at, std::min<qsizetype>(random.bounded(4) + 1, line.size() - at));
+        } else {
+            line.insert(at, pieces.at(random.bounded(pieces.size())));
+        }
+
+        const auto text = line.join(QString());
+
+        QCOMPARE(console.highlight(text), highlight(text));
+    }
+}
+
+void QConsoleTester::serverTest()
+{
+    QConsole console;
+    console.addDefaultCommands();
+    console.setDefaultPrompt("> ");
+
+    console.addCommand({
+      "login",
+      "Random description...",
+      [&](const QConsole::Context& ctx) { console.setPrompt(ctx.arguments.join(" ") + "> "); },
+    });
+
+    const auto name = QStringLiteral("qconsole-test-%1").arg(QCoreApplication::applicationPid());
+
+    QVERIFY(console.listen(name));
+
+    QLocalSocket a;
+    QLocalSocket b;
+    QByteArray   outputA;
+    QByteArray   outputB;
+
+    connect(&a, &QLocalSocket::readyRead, [&]() { outputA += a.readAll(); });
+    connect(&b, &QLocalSocket::readyRead, [&]() { outputB += b.readAll(); });
+
+    a.connectToServer(name);
+    b.connectToServer(name);
+
+    QTRY_COMPARE(outputA, QByteArray("> "));
+    QTRY_COMPARE(outputB, QByteArray("> "));
+
+    // Each session has its own prompt, and lines may be split across writes.
+    a.write("login al");
+    a.flush();
+    a.write("ice\r\n");
+    b.write("login bob\nping\n");
+
+    const auto error = QConsole::colorize("Command not found: ping", QConsole::Color::Red, QConsole::Style::Normal);
+
+    QTRY_COMPARE(outputA, QByteArray("> alice> "));
+    QTRY_COMPARE(outputB, "> bob> " + error.toUtf8() + "\nbob> ");
+
+    QVERIFY(console.prompt() == "> ");
+
+    // "exit" closes the session instead of quitting.
+    a.write("exit\n");
+
+    QTRY_COMPARE(a.state(), QLocalSocket::UnconnectedState);
+    QCOMPARE(b.state(), QLocalSocket::ConnectedState);
+
+    // Even when run in the background, since it runs on the console thread for the session.
+    QLocalSocket c;
+    QByteArray   outputC;
+
+    connect(&c, &QLocalSocket::readyRead, [&]() { outputC += c.readAll(); });
+
+    c.connectToServer(name);
+
+    QTRY_COMPARE(outputC, QByteArray("> "));
+
+    c.write("exit &\n");
+
+    QTRY_COMPARE(c.state(), QLocalSocket::UnconnectedState);
+    QCOMPARE(b.state(), QLocalSocket::ConnectedState);
+
+    // The socket of a server still accepting sessions isn't taken over.
+    QConsole other;
+    QVERIFY(!other.listen(name));
+
+    // A line without an end closes the session as soon as it's too long.
+    QLocalSocket d;
+    QByteArray   outputD;
+
+    connect(&d, &QLocalSocket::readyRead, [&]() { outputD += d.readAll(); });
+
+    d.connectToServer(name);
+    d.write(QByteArray(64 * 1024 + 1, 'x'));
+
+    QTRY_COMPARE(d.state(), QLocalSocket::UnconnectedState);
+    QVERIFY(outputD.contains("Line too long"));
+    QCOMPARE(b.state(), QLocalSocket::ConnectedState);
+
+    console.stopListening();
+
+    QTRY_COMPARE(b.state(), QLocalSocket::UnconnectedState);
+
+    // The clients of a TCP port must send the token first.
+    quint16 port = 40000 + quint16(QCoreApplication::applicationPid() % 1000);
+
+    while (!console.listen(port, "secret")) {
+        QVERIFY(++port < 50000);
+    }
+
+    QTcpSocket e;
+    QTcpSocket f;
+    QByteArray outputE;
+    QByteArray outputF;
+
+    connect(&e, &QTcpSocket::readyRead, [&]() { outputE += e.readAll(); });
+    connect(&f, &QTcpSocket::readyRead, [&]() { outputF += f.readAll(); });
+
+    e.connectToHost(QHostAddress::LocalHost, port);
+    f.connectToHost(QHostAddress::LocalHost, port);
+    e.write("guess\nexit\n");
+    f.write("secret\n");
+
+    QTRY_COMPARE(e.state(), QTcpSocket::UnconnectedState);
+    QVERIFY(outputE.contains("Authentication failed"));
+    QTRY_COMPARE(outputF, QByteArray("> "));
+
+    console.stopListening();
+}
+
+void QConsoleTester::registryTest()
+{
+    auto a = std::make_unique<QConsole>();
+    a->addDefaultCommands();
+
+    QConsole  b(a->registry());
+    QConsole* invoker = nullptr;
+
+    QVERIFY(b.registry() == a->registry());
+
+    a->addCommand({
+      "ping",
+      "Random description...",
+      [&](const QConsole::Context& ctx) { invoker = ctx.console; },
+    });
+
+    QCOMPARE(b.commandCount(), a->commandCount());
+    QVERIFY(b.complete("pi") == QList<QString>{ "ping" });
+
+    QVERIFY(b.invokeCommandByName("ping"));
+    QVERIFY(invoker == &b);
+
+    b.setPrompt("b> ");
+    QVERIFY(a->prompt() != "b> ");
+
+    // The commands outlive the console they were added to.
+    a.reset();
+
+    QString     output;
+    QTextStream stream(&output);
+
+    QVERIFY(b.invokeCommandByName("help", QConsole::Context{ {}, &stream }));
+    QVERIFY(output.contains("ping"));
+}
+
+void QConsoleTester::registryStressTest()
+{
+    constexpr int writerCount  = 8;
+    constexpr int commandCount = 500;
+
+    QConsole         c;
+    std::atomic<int> invocations = 0;
+
+    c.addCommand({
+      "stable",
+      "Random description...",
+      [&](const QConsole::Context& ctx) {
+          Q_UNUSED(ctx);
+          invocations++;
+      },
+    });
+
+    std::atomic<bool>        done = false;
+    std::vector<std::thread> writers;
+
+    // Each writer adds its commands and removes every other one while the reader is busy.
+    for (int i = 0; i < writerCount; ++i) {
+        writers.emplace_back([&c, i]() {
+            for (int j = 0; j < commandCount; ++j) {
+                c.addCommand({ QStringLiteral("writer%1 command%2").arg(i).arg(j), "Random description...",
+                               [](const QConsole::Context& ctx) { Q_UNUSED(ctx); } });
+
+                if (j % 2 == 1) {
+                    c.removeCommandByName(QStringLiteral("writer%1 command%2").arg(i).arg(j - 1));
+                }
+            }
+        });
+    }
+
+    std::thread joiner([&writers, &done]() {
+        for (auto& writer : writers) {
+            writer.join();
+        }
+
+        done = true;
+    });
+
+    // The reader only verifies once the writers are done, so that a failure doesn't leave them running.
+    int  reads      = 0;
+    bool consistent = true;
+
+    while (!done) {
+        consistent &= c.invokeCommandByName("stable");
+        consistent &= c.complete("st") == QList<QString>{ "stable" };
+        consistent &= c.commandCount() <= size_t(1 + writerCount * commandCount);
+
+        c.complete(QStringLiteral("writer%1 comm").arg(reads % writerCount));
+        c.invokeCommandByName(QStringLiteral("writer%1 command%2").arg(reads % writerCount).arg(reads % commandCount));
+        reads++;
+    }
+
+    joiner.join();
+
+    QVERIFY(consistent);
+    QCOMPARE(invocations.load(), reads);
+    QCOMPARE(c.commandCount(), size_t(1 + writerCount * commandCount / 2));
+    QCOMPARE(c.complete("writer0 command").size(), commandCount / 2);
+}
+
+void QConsoleTester::ptyLatencyTest()
+{
+#ifndef QCONSOLE_PTY_CONSOLE
+    QSKIP("Pseudo-terminals are only supported on Unix.");
+#else
+    PtyHarness pty;
+
+    QVERIFY(pty.start(QCONSOLE_PTY_CONSOLE));
+    QVERIFY(pty.waitFor("> ", 10000));
+
+    // Complete the common prefix of the commands, type a line, and erase the end of it.
+    QList<QByteArray> keys = { "c", "o", "m", "\t" };
+
+    for (const auto c : QByteArray("42 --flag 'quoted' 42")) {
+        keys.append(QByteArray(1, c));
+    }
+
+    keys << "\x7f" << "\x7f" << "\x7f";
+
+    QList<qint64> latencies;
+    qint64        bytes = 0;
+
+    for (const auto& key : keys) {
+        const auto keystroke = pty.type(key, 50);
+
+        QVERIFY(keystroke.bytes > 0);
+
+        latencies.append(keystroke.latency);
+        bytes += keystroke.bytes;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    qInfo("Keystroke to redraw: p50 %.2f ms, max %.2f ms, %.1f bytes per keystroke",
+          double(latencies[latencies.size() / 2]) / 1e6, double(latencies.last()) / 1e6,
+          double(bytes) / double(keys.size()));
+
+    // The maximum latency may be raised on slow machines.
+    const auto maximum = qEnvironmentVariableIsSet("QCONSOLE_PTY_MAX_LATENCY")
+                           ? qEnvironmentVariableIntValue("QCONSOLE_PTY_MAX_LATENCY")
+                           : 200;
+
+    QVERIFY(latencies.last() < qint64(maximum) * 1000000);
+
+    // Erase the line and quit with ctrl+d.
+    pty.type("\x15", 50);
+    pty.type("\x04", 50);
+
+    QVERIFY(pty.stop(5000) == 0);
+#endif
+}
+
+void QConsoleTester::pagerTest()
+{
+#ifndef QCONSOLE_PTY_CONSOLE
+    QSKIP("Pseudo-terminals are only supported on Unix.");
+#else
+    PtyHarness pty;
+
+    QVERIFY(pty.start(QCONSOLE_PTY_CONSOLE));
+    QVERIFY(pty.waitFor("> ", 10000));
+
+    // The help of the 10000 commands stops at the first page of the 24 rows terminal.
+    pty.type("help\r", 50);
+
+    QVERIFY(pty.waitFor("--More--", 10000));
+    QVERIFY(pty.output().count("Random description...") < 24);
+
+    // Skip to a command further down.
+    pty.type("/command-9000\r", 50);
+
+    QVERIFY(pty.waitFor("...skipping", 10000));
+    QVERIFY(pty.waitFor("command-9000\33[0m: ", 10000));
+    QVERIFY(pty.output().count("Random description...") < 48);
+
+    // A search matching nothing skips the rest of the output without keeping it, and is reported on the
+    // status line before the pager ends.
+    pty.type("/no-such-command\r", 50);
+
+    QVERIFY(pty.waitFor("Pattern not found", 10000));
+    QVERIFY(pty.output().count("Random description...") < 48);
+
+    pty.type(" ", 50);
+    pty.type("\x04", 50);
+
+    QVERIFY(pty.stop(5000) == 0);
+#endif
+}
+
+void QConsoleTester::completionBenchmark_data()
+{
+    QTest::addColumn<bool>("cached");
+
+    QTest::addRow("trie") << false;
+    QTest::addRow("cached") << true;
+}
+
+void QConsoleTester::completionBenchmark()
+{
+    QFETCH(bool, cached);
+
+    QConsole console;
+
+    for (int i = 0; i < 100000; ++i) {
+        console.addCommand({
+          QStringLiteral("command-%1").arg(i),
+          "Random description...",
+          [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+        });
+    }
+
+    // Type a name one character at a time, as the hint and completion callbacks see it. Without the
+    // cache, a word matching nothing is completed in between so that each keystroke searches the
+    // trie again.
+    QBENCHMARK
+    {
+        for (const auto& input : { "c", "co", "com", "comm", "comma", "comman", "command", "command-", "command-4",
+                                   "command-42", "command-421" }) {
+            if (!cached) {
+                console.complete("x");
+            }
+
+            console.complete(input);
+        }
+    }
+}
+
+void QConsoleTester::fuzzyCompletionBenchmark()
+{
+    QConsole console;
+
+    for (int i = 0; i < 100000; ++i) {
+        console.addCommand({
+          QStringLiteral("command-%1-name").arg(i),
+          "Random description...",
+          [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+        });
+    }
+
+    console.setFuzzyCompletion(true);
+
+    // Build the index once so that only the scan is measured.
+    QVERIFY(console.complete("c9n").size() == 64);
+
+    QBENCHMARK
+    {
+        console.complete("c9n");
+        console.complete("cmd42");
+        console.complete("xyz");
+    }
+}
+
+void QConsoleTester::tokenizeBenchmark()
+{
+    QConsole console;
+
+    console.addCommand({
+      "command",
+      "Random description...",
+      [](const QConsole::Context& ctx) { Q_UNUSED(ctx) },
+    });
+
+    const auto script = [](QTemporaryFile& file, int lines) {
+        QVERIFY(file.open());
+
+        for (int i = 0; i < lines; ++i) {
+            file.write("command \"quoted argument\" 'single quoted' escaped\\ argument 12345\n");
+        }
+    };
+
+    QTemporaryFile large;
+    script(large, 100000);
+
+    // The allocations are counted by "test-allocations".
+    QBENCHMARK
+    {
+        large.seek(0);
+        console.runScript(&large);
+    }
+}
+
 void QConsoleTester::promptTest()
 {
     QConsole console;
@@ -37,7 +37,38 @@ private:
     Q_SLOT void unicodeTest();
     Q_SLOT void promptTest();
     Q_SLOT void colorizeTest();
+    Q_SLOT void scriptTest();
+    Q_SLOT void batchTest();
+    Q_SLOT void asyncTest();
+    Q_SLOT void printTest();
+    Q_SLOT void tokenizeTest();
+    Q_SLOT void pipelineTest();
+    Q_SLOT void jobsTest();
+    Q_SLOT void freezeTest();
+    Q_SLOT void subcommandTest();
+    Q_SLOT void fuzzyCompletionTest();
+    Q_SLOT void completionCacheTest();
+    Q_SLOT void argumentCompletionTest();
+    Q_SLOT void commandSourceTest();
+    Q_SLOT void historyJournalTest();
+    Q_SLOT void historySearchTest();
+    Q_SLOT void sharedHistoryTest();
+    Q_SLOT void statisticsTest();
+    Q_SLOT void highlightTest();
+    Q_SLOT void highlightEditTest();
+    Q_SLOT void serverTest();
+    Q_SLOT void registryTest();
+    Q_SLOT void registryStressTest();
+    Q_SLOT void ptyLatencyTest();
+    Q_SLOT void pagerTest();
 
+    Q_SLOT void populateBenchmark_data();
     Q_SLOT void populateBenchmark();
+    Q_SLOT void evaluateBenchmark_data();
     Q_SLOT void evaluateBenchmark();
+    Q_SLOT void scriptBenchmark();
+    Q_SLOT void tokenizeBenchmark();
+    Q_SLOT void fuzzyCompletionBenchmark();
+    Q_SLOT void completionBenchmark_data();
+    Q_SLOT void completionBenchmark();
 };